@@ -0,0 +1,20 @@
+#!/bin/sh
+# Builds and runs the headless benchmarks for each world size the
+# simulation is tuned for: the game's 20x20, power of two worlds
+# where the wrap-around is a mask, and a large match of 256 snakes.
+# Each size runs with both rollback histories, full snapshots and the
+# undo log. Arguments go to snake_headless, e.g. -m for JSON lines,
+# which carry the world size.
+set -e
+for config in 20:8 64:8 1024:8 512:256; do
+    size=${config%:*}
+    snakes=${config#*:}
+    for undo in 0 1; do
+        WORLD_W=$size WORLD_H=$size MAX_SNAKES=$snakes ROLLBACK_UNDO_LOG=$undo ./build_headless.sh
+        case " $* " in
+            *" -m "*) ;;
+            *) printf '\n=== %sx%s, %s snakes, undo log %s ===\n' $size $size $snakes $undo ;;
+        esac
+        ./snake_headless "$@"
+    done
+done
@@ -48,7 +48,15 @@ typedef struct Context_Extra {
 #include "game/config.c"
 #include "game/byte_queue.c"
 #include "game/steam_wrapper.h"
+#include "game/transport.c"
 #include "game/net.c"
+#include "game/undo.c"
 #include "game/game.c"
+#include "game/history.c"
+#include "game/replay.c"
 #include "game/rollback.c"
+#include "game/batch.c"
 #include "game/entry.c"
+
+// Uncomment this and set ENTRY_PROC to bench_entry to run the simulation benchmarks
+// #include "game/bench.c"
@@ -0,0 +1,23 @@
+// Unity build of the simulation without graphics, audio or Steam, for
+// benchmarking on Linux. Use build_headless.sh to compile it.
+
+#define HAVE_STEAM 0
+
+#include "game/headless.c"
+#include "game/utils.c"
+#include "game/config.c"
+#include "game/byte_queue.c"
+#include "game/transport.c"
+#include "game/net.c"
+#include "game/undo.c"
+#include "game/game.c"
+#include "game/history.c"
+#include "game/replay.c"
+#include "game/rollback.c"
+#include "game/batch.c"
+#include "game/bench.c"
+
+int main(int argc, char **argv)
+{
+    return bench_entry(argc, argv);
+}
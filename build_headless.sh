@@ -0,0 +1,13 @@
+#!/bin/sh
+# Builds the headless simulation benchmarks. The world size and snake
+# count are compile time constants, override them like this:
+#
+#   WORLD_W=64 WORLD_H=64 MAX_SNAKES=8 ./build_headless.sh
+#
+# MAX_WORLD_W and MAX_WORLD_H set the largest world a match can have,
+# by default the same as WORLD_W and WORLD_H. MAX_APPLES sets the most
+# apples on the board.
+#
+# ROLLBACK_UNDO_LOG=1 builds the undo log version of the rollback history.
+#
+${CC:-cc} -o snake_headless build_headless.c -g -O2 -std=c11 -D_POSIX_C_SOURCE=200809L -DWORLD_W=${WORLD_W:-20} -DWORLD_H=${WORLD_H:-20} -DMAX_SNAKES=${MAX_SNAKES:-8} ${MAX_WORLD_W:+-DMAX_WORLD_W=$MAX_WORLD_W} ${MAX_WORLD_H:+-DMAX_WORLD_H=$MAX_WORLD_H} ${MAX_APPLES:+-DMAX_APPLES=$MAX_APPLES} -DROLLBACK_UNDO_LOG=${ROLLBACK_UNDO_LOG:-0} -Wextra -Wno-sign-compare -Wno-unused-parameter -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc -pthread -lm
@@ -0,0 +1,191 @@
+/*
+ * Batched simulation of independent matches, for bot training and
+ * balance sweeps. Every instance has its own GameState, seed and input
+ * stream and nothing here touches the globals of the interactive game
+ * (latest_game_state, multiplayer, self_snake_index, ...), so the
+ * instances can be stepped by several threads at once.
+ *
+ * The instances are split evenly between the workers up front. A
+ * worker that runs out of instances steals half of the ones another
+ * worker has left, which keeps all of them busy when some matches
+ * last much longer than others.
+ */
+
+#define MAX_BATCH_WORKERS 64
+
+// Writes the inputs of the instance for frame game->frame_index to
+// inputs and returns how many there are. It's called by the workers,
+// so it may only touch data that belongs to the instance.
+typedef int (*BatchInputProc)(void *user_data, u32 instance, GameState *game, Input *inputs, int max_inputs);
+
+typedef struct {
+    // Instances [begin, end) still to be run by this worker, packed as
+    // begin | end << 32 so that the owner and the thieves can update
+    // both with a single compare and swap.
+    u64 range;
+
+    u64 frames_simulated;
+
+    // Keep each queue on its own cache line
+    u8 padding[64 - 2 * sizeof(u64)];
+} BatchQueue;
+
+typedef struct Batch Batch;
+
+typedef struct {
+    Batch *batch;
+    int index;
+    Thread thread;
+} BatchWorker;
+
+struct Batch {
+    GameState *instances;
+    u32 num_instances;
+    u64 max_frames;
+
+    BatchInputProc get_inputs;
+    void *user_data;
+
+    int num_workers;
+    BatchQueue  queues[MAX_BATCH_WORKERS];
+    BatchWorker workers[MAX_BATCH_WORKERS];
+};
+
+// Sets up an instance the same way for any thread count, so results
+// only depend on the seed.
+void batch_init_instance(GameState *game, u64 seed, int num_snakes, bool multiplayer)
+{
+    init_game_state(game, multiplayer);
+    game->seed = seed;
+    for (int i = 0; i < num_snakes; i++)
+        spawn_snake(game);
+}
+
+void batch_init(Batch *batch, GameState *instances, u32 num_instances, int num_workers, BatchInputProc get_inputs, void *user_data)
+{
+    assert(num_workers > 0 && num_workers <= MAX_BATCH_WORKERS);
+
+    memset(batch, 0, sizeof(Batch));
+    batch->instances = instances;
+    batch->num_instances = num_instances;
+    batch->get_inputs = get_inputs;
+    batch->user_data = user_data;
+    batch->num_workers = num_workers;
+}
+
+u64 pack_batch_range(u32 begin, u32 end)
+{
+    return (u64) begin | ((u64) end << 32);
+}
+
+// Takes the first instance of the worker's own queue
+bool pop_batch_instance(BatchQueue *queue, u32 *instance)
+{
+    for (;;) {
+        u64 range = *(volatile u64*) &queue->range;
+        u32 begin = range, end = range >> 32;
+        if (begin >= end)
+            return false;
+        if (compare_and_swap_64(&queue->range, pack_batch_range(begin + 1, end), range)) {
+            *instance = begin;
+            return true;
+        }
+    }
+}
+
+// Moves the second half of the instances left to some other worker
+// into the empty queue of the thief
+bool steal_batch_instances(Batch *batch, int thief)
+{
+    for (int i = 1; i < batch->num_workers; i++) {
+
+        BatchQueue *victim = &batch->queues[(thief + i) % batch->num_workers];
+
+        for (;;) {
+            u64 range = *(volatile u64*) &victim->range;
+            u32 begin = range, end = range >> 32;
+            if (begin >= end)
+                break;
+
+            u32 middle = begin + (end - begin) / 2;
+            if (compare_and_swap_64(&victim->range, pack_batch_range(begin, middle), range)) {
+                BatchQueue *queue = &batch->queues[thief];
+                u64 old = *(volatile u64*) &queue->range;
+                while (!compare_and_swap_64(&queue->range, pack_batch_range(middle, end), old))
+                    old = *(volatile u64*) &queue->range;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+u64 run_batch_instance(Batch *batch, u32 index)
+{
+    GameState *game = &batch->instances[index];
+
+    Input inputs[4 * MAX_SNAKES];
+    u64 frames = 0;
+
+    while (!game->game_complete && game->frame_index < batch->max_frames) {
+
+        int num_inputs = batch->get_inputs(batch->user_data, index, game, inputs, COUNTOF(inputs));
+        for (int i = 0; i < num_inputs; i++)
+            apply_input_to_game_instance(game, inputs[i]);
+
+        update_game_instance(game);
+        frames++;
+    }
+    return frames;
+}
+
+void batch_worker_proc(Thread *thread)
+{
+    BatchWorker *worker = thread->data;
+    Batch *batch = worker->batch;
+    BatchQueue *queue = &batch->queues[worker->index];
+
+    u64 frames = 0;
+    for (;;) {
+        u32 instance;
+        if (pop_batch_instance(queue, &instance))
+            frames += run_batch_instance(batch, instance);
+        else if (!steal_batch_instances(batch, worker->index))
+            break; // No work is ever added, so everyone else is busy or done
+    }
+    queue->frames_simulated = frames;
+}
+
+// Steps every instance until its match is complete or it reaches
+// max_frames, and returns the number of frames simulated. The calling
+// thread is used as the first worker.
+u64 batch_run(Batch *batch, u64 max_frames)
+{
+    batch->max_frames = max_frames;
+
+    for (int i = 0; i < batch->num_workers; i++) {
+        u32 begin = (u64) batch->num_instances * (i + 0) / batch->num_workers;
+        u32 end   = (u64) batch->num_instances * (i + 1) / batch->num_workers;
+        batch->queues[i].range = pack_batch_range(begin, end);
+        batch->queues[i].frames_simulated = 0;
+
+        BatchWorker *worker = &batch->workers[i];
+        worker->batch = batch;
+        worker->index = i;
+        os_thread_init(&worker->thread, batch_worker_proc);
+        worker->thread.data = worker;
+    }
+
+    for (int i = 1; i < batch->num_workers; i++)
+        os_thread_start(&batch->workers[i].thread);
+
+    batch_worker_proc(&batch->workers[0].thread);
+
+    for (int i = 1; i < batch->num_workers; i++)
+        os_thread_join(&batch->workers[i].thread);
+
+    u64 frames = 0;
+    for (int i = 0; i < batch->num_workers; i++)
+        frames += batch->queues[i].frames_simulated;
+    return frames;
+}
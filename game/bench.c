@@ -0,0 +1,1344 @@
+/*
+ * Simulation benchmarks.
+ *
+ * On Linux build them with build_headless.sh and run ./snake_headless.
+ * In the game build include this file after game/entry.c in build.c
+ * and set ENTRY_PROC to bench_entry.
+ *
+ * Options:
+ *   -m      Print one JSON object per result instead of tables
+ *   -s <n>  Snake count for the multi-snake benchmarks (default MAX_SNAKES)
+ *   -j <n>  Most worker threads for the batch benchmark (default 1)
+ *   -w <f>  Save the replay of the first match of the replay benchmark to f
+ *   -r <f>  Only play the replay in f at full speed and check its outcome
+ */
+
+#define BENCH_PATH_LEN (WORLD_W * WORLD_H)
+
+#ifndef HAVE_ALLOCATION_COUNTER
+#define HAVE_ALLOCATION_COUNTER 0
+#endif
+
+bool bench_machine_readable = false;
+
+// Benchmarks that keep many states at once use at most this much
+// memory for them, so they run on large worlds with fewer states
+#define BENCH_STATE_MEMORY (256 << 20)
+
+u32 bench_max_states(u32 wanted)
+{
+    u32 fit = BENCH_STATE_MEMORY / sizeof(GameState);
+    return MAX(2, MIN(wanted, fit));
+}
+
+// Benchmarks that copy whole states in their loops run fewer
+// iterations when the state is larger than this, so that large worlds
+// take about as long to benchmark as small ones
+#define BENCH_REFERENCE_STATE_SIZE (16 << 10)
+
+int bench_scaled_iterations(int wanted, int least)
+{
+    u64 scaled = (u64) wanted * BENCH_REFERENCE_STATE_SIZE / sizeof(GameState);
+    return MAX(least, MIN(wanted, scaled));
+}
+
+GameState *bench_alloc_states(u32 count)
+{
+    GameState *states = alloc(get_heap_allocator(), (u64) count * sizeof(GameState));
+    assert(states, "Out of memory for the benchmark states");
+    return states;
+}
+
+u64 bench_allocations(void)
+{
+#if HAVE_ALLOCATION_COUNTER
+    return get_allocation_count();
+#else
+    return 0;
+#endif
+}
+
+void bench_section(char *title, char *param_name, char *unit)
+{
+    if (bench_machine_readable) return;
+    printf("\n%cs\n", title);
+    printf("%6s %10s %12s %8s\n", "snakes", param_name, unit, "allocs");
+}
+
+// Prints a result as a row of the current table, or as a JSON object
+// on its own line in machine readable mode. Allocations are the ones
+// made while measuring, -1 when the build can't count them.
+void bench_report(char *bench, int snakes, u32 param, char *unit, double value, u64 allocations)
+{
+    int allocs = HAVE_ALLOCATION_COUNTER ? (int) allocations : -1;
+    if (bench_machine_readable)
+        printf("{\"bench\": \"%cs\", \"world_w\": %d, \"world_h\": %d, \"snakes\": %d, \"param\": %d, \"unit\": \"%cs\", \"value\": %.1f, \"allocs\": %d}\n",
+            bench, WORLD_W, WORLD_H, snakes, (int) param, unit, value, allocs);
+    else
+        printf("%6d %10d %12.1f %8d\n", snakes, (int) param, value, allocs);
+}
+
+// The benchmarks move snakes along a serpentine that visits every
+// cell once: even rows are walked left to right, odd rows right to
+// left. With an even number of rows the last cell sits right below
+// the first one, so the path wraps around and the snakes can follow
+// it forever without colliding.
+_Static_assert(WORLD_H % 2 == 0, "The benchmark path needs an even number of rows");
+
+void bench_path_cell(u32 i, u32 *x, u32 *y)
+{
+    i %= BENCH_PATH_LEN;
+    *y = i / WORLD_W;
+    *x = (*y % 2 == 0) ? i % WORLD_W : WORLD_W - 1 - i % WORLD_W;
+}
+
+Direction bench_path_dir(u32 i)
+{
+    u32 x0, y0, x1, y1;
+    bench_path_cell(i+0, &x0, &y0);
+    bench_path_cell(i+1, &x1, &y1);
+    if (x1 == x0 + 1) return DIR_RIGHT;
+    if (x1 + 1 == x0) return DIR_LEFT;
+    if (y1 == (y0 + 1) % WORLD_H) return DIR_UP;
+    return DIR_DOWN;
+}
+
+// Builds a snake covering the path cells [start, start+len) with the
+// head on the last one by feeding it an apple at each step.
+void bench_grow_snake_on_path(GameState *game, u32 start, u32 len)
+{
+    u32 x, y;
+    bench_path_cell(start, &x, &y);
+
+    Snake *s = find_unused_snake_slot(game);
+    init_snake(game, s, x, y);
+
+    for (u32 i = 1; i < len; i++) {
+        bench_path_cell(start + i, &x, &y);
+        place_apple(game, x, y);
+        s->next_dir = bench_path_dir(start + i - 1);
+        move_snake_forwards(game, s);
+    }
+    s->next_dir = bench_path_dir(start + len - 1);
+}
+
+// Longest snakes that fit on the path when there are num_snakes of them
+u32 bench_max_snake_len(int num_snakes)
+{
+    return (BENCH_PATH_LEN - MAX_APPLES) / num_snakes - 1;
+}
+
+// Lays out num_snakes snakes of len cells each along the path with
+// one free cell in front of every head and the apples right after
+// the last snake, so that a tick moves every snake without any of
+// them dying or growing.
+void bench_setup_snakes(GameState *game, int num_snakes, u32 len)
+{
+    assert(len <= bench_max_snake_len(num_snakes));
+
+    init_game_state(game, false);
+    for (int i = 0; i < num_snakes; i++)
+        bench_grow_snake_on_path(game, i * (len + 1), len);
+
+    for (int i = 0; i < MAX_APPLES; i++) {
+        u32 x, y;
+        bench_path_cell(num_snakes * (len + 1) + i, &x, &y);
+        place_apple(game, x, y);
+    }
+}
+
+typedef void (*BenchStateOp)(GameState *game);
+
+// Average cost of op in nanoseconds, where every call starts from a
+// copy of the template state left in game. The cost of the copies is
+// measured separately and subtracted. On large worlds the copy costs
+// far more than op and the difference drowns in noise, so there the
+// calls are timed one by one instead.
+double bench_op_on_copies_ns(GameState *template, GameState *game, int iterations, BenchStateOp op, u64 *allocations)
+{
+    if (sizeof(GameState) > BENCH_REFERENCE_STATE_SIZE) {
+        float64 op_time = 0;
+        u64 allocs_before = bench_allocations();
+        for (int i = 0; i < iterations; i++) {
+            memcpy(game, template, sizeof(GameState));
+            float64 start = os_get_current_time_in_seconds();
+            op(game);
+            op_time += os_get_current_time_in_seconds() - start;
+        }
+        *allocations = bench_allocations() - allocs_before;
+        return op_time * 1e9 / iterations;
+    }
+
+    float64 start = os_get_current_time_in_seconds();
+    for (int i = 0; i < iterations; i++)
+        memcpy(game, template, sizeof(GameState));
+    float64 copy_time = os_get_current_time_in_seconds() - start;
+
+    u64 allocs_before = bench_allocations();
+    start = os_get_current_time_in_seconds();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(game, template, sizeof(GameState));
+        op(game);
+    }
+    float64 total_time = os_get_current_time_in_seconds() - start;
+    *allocations = bench_allocations() - allocs_before;
+
+    return (total_time - copy_time) * 1e9 / iterations;
+}
+
+// Average cost of one update_game_instance in nanoseconds, every tick
+// starting from the template state
+double bench_tick_ns(GameState *template, int iterations, u64 *allocations)
+{
+    static GameState game;
+    double ns = bench_op_on_copies_ns(template, &game, iterations, update_game_instance, allocations);
+    assert(count_snakes(&game) == count_snakes(template));
+    return ns;
+}
+
+void bench_refill_apples(GameState *game)
+{
+    make_sure_there_is_at_least_this_amount_of_apples(game, MAX_APPLES);
+}
+
+void bench_collisions(int num_snakes)
+{
+    static GameState template;
+
+    int iterations = bench_scaled_iterations(100000, 100);
+    u32 lengths[] = {1, 6, 12, 24, 50, 100, 200, 1000, 10000};
+    int snake_counts[] = {1, num_snakes};
+
+    bench_section("Tick cost as snakes grow", "length", "ns/tick");
+
+    for (int i = 0; i < COUNTOF(snake_counts); i++) {
+
+        // Each table ends with the longest snakes that fit
+        u32 max_len = bench_max_snake_len(snake_counts[i]);
+        for (int j = 0; j <= COUNTOF(lengths); j++) {
+
+            u32 len = j < COUNTOF(lengths) ? lengths[j] : max_len;
+            if (j < COUNTOF(lengths) && len >= max_len) continue;
+
+            u64 allocs;
+            bench_setup_snakes(&template, snake_counts[i], len);
+            double ns = bench_tick_ns(&template, iterations, &allocs);
+            bench_report("tick", snake_counts[i], len, "ns/tick", ns, allocs);
+        }
+    }
+}
+
+// Cost of refilling all apples when the snakes leave only a
+// handful of cells free, which is the common case at the end of
+// a match.
+void bench_apple_spawning(void)
+{
+    static GameState template;
+    static GameState game;
+
+    int iterations = bench_scaled_iterations(100000, 100);
+    u32 free_cells[] = {BENCH_PATH_LEN / 2, BENCH_PATH_LEN / 10, 2 * MAX_APPLES, MAX_APPLES + 1};
+
+    bench_section("Apple spawning on a crowded board", "free cells", "ns/spawn");
+
+    for (int i = 0; i < COUNTOF(free_cells); i++) {
+
+        bench_setup_snakes(&template, 1, BENCH_PATH_LEN - free_cells[i]);
+        while (count_apples(&template) > 0)
+            consume_apple_at(&template, template.apples[0].x, template.apples[0].y);
+
+        u64 allocs;
+        double ns = bench_op_on_copies_ns(&template, &game, iterations, bench_refill_apples, &allocs);
+
+        assert(count_apples(&game) == MAX_APPLES);
+        bench_report("apple_spawn", 1, free_cells[i], "ns/spawn", ns / MAX_APPLES, allocs);
+    }
+}
+
+// Cost of the copy done for every snapshot
+void bench_state_copy(int num_snakes)
+{
+    static GameState template;
+
+    int iterations = bench_scaled_iterations(100000, 100);
+
+    bench_setup_snakes(&template, num_snakes, MIN(24, bench_max_snake_len(num_snakes)));
+
+    u64 allocs_before = bench_allocations();
+    float64 start = os_get_current_time_in_seconds();
+    for (int i = 0; i < iterations; i++)
+        memcpy(&snapshots[i % NUM_SNAPSHOTS], &template, sizeof(GameState));
+    float64 copy_time = os_get_current_time_in_seconds() - start;
+    u64 allocs = bench_allocations() - allocs_before;
+
+    bench_section("Game state copies", "bytes", "ns/copy");
+    bench_report("state_copy", num_snakes, sizeof(GameState), "ns/copy", copy_time * 1e9 / iterations, allocs);
+}
+
+typedef struct {
+    double tick_ns;  // Normal tick, including the snapshot
+    double resim_ns; // Per re-simulated frame
+    u64 allocations;
+} BenchRollbackResult;
+
+// Plays a synthetic input trace through the rollback code. Every
+// snake follows the path, the first one through local inputs and the
+// others through inputs that arrive `delay` frames late like the ones
+// of remote players, so every frame rolls back `delay` frames. Rounds
+// last two rollback windows and start over from a fresh board.
+BenchRollbackResult bench_rollback(int num_snakes, u32 delay, int rounds)
+{
+    assert(delay <= MAX_ROLLBACK_FRAMES);
+
+    u32 len = MIN(8, bench_max_snake_len(num_snakes));
+    u32 frames_per_round = 2 * MAX_ROLLBACK_FRAMES;
+
+    float64 advance_time = 0;
+    float64 recalculate_time = 0;
+    u64 frames = 0;
+    u64 frames_resimulated_before = rollback_stats.frames_resimulated;
+    u64 allocs_before = bench_allocations();
+
+    for (int round = 0; round < rounds; round++) {
+
+        input_table_init();
+        bench_setup_snakes(&latest_game_state, num_snakes, len);
+        init_rollback_history();
+
+        for (u32 f = 0; f < frames_per_round; f++) {
+
+            for (int p = 0; p < num_snakes; p++) {
+                u32 head = p * (len + 1) + len - 1;
+                u32 lag = p == 0 ? 0 : delay;
+                if (f < lag) continue; // Nothing sent yet
+                u64 time = f - lag;
+                apply_input_to_game((Input) {.time=time, .player=p, .dir=bench_path_dir(head + time)});
+            }
+
+            float64 start = os_get_current_time_in_seconds();
+            recalculate_latest_state();
+            float64 middle = os_get_current_time_in_seconds();
+            advance_latest_state();
+            float64 end = os_get_current_time_in_seconds();
+
+            recalculate_time += middle - start;
+            advance_time += end - middle;
+            frames++;
+        }
+    }
+
+    u64 frames_resimulated = rollback_stats.frames_resimulated - frames_resimulated_before;
+
+    BenchRollbackResult result;
+    result.tick_ns = advance_time * 1e9 / frames;
+    result.resim_ns = frames_resimulated ? recalculate_time * 1e9 / frames_resimulated : 0;
+    result.allocations = bench_allocations() - allocs_before;
+    return result;
+}
+
+void bench_rollbacks(int num_snakes)
+{
+    u32 delays[] = {0, 1, 4, 16, MAX_ROLLBACK_FRAMES};
+    BenchRollbackResult results[COUNTOF(delays)];
+
+    for (int i = 0; i < COUNTOF(delays); i++)
+        results[i] = bench_rollback(num_snakes, delays[i], bench_scaled_iterations(200, 1));
+
+#if ROLLBACK_UNDO_LOG
+    char *mode = " (undo log)", *suffix = "_undo";
+#else
+    char *mode = "", *suffix = "";
+#endif
+    char title[64], bench[64];
+
+    snprintf(title, sizeof(title), "Rollback, normal ticks%s", mode);
+    snprintf(bench, sizeof(bench), "rollback_tick%s", suffix);
+    bench_section(title, "delay", "ns/tick");
+    for (int i = 0; i < COUNTOF(delays); i++)
+        bench_report(bench, num_snakes, delays[i], "ns/tick", results[i].tick_ns, results[i].allocations);
+
+    snprintf(title, sizeof(title), "Rollback, re-simulated frames%s", mode);
+    snprintf(bench, sizeof(bench), "rollback_resim%s", suffix);
+    bench_section(title, "delay", "ns/frame");
+    for (int i = 0; i < COUNTOF(delays); i++)
+        if (delays[i] > 0)
+            bench_report(bench, num_snakes, delays[i], "ns/frame", results[i].resim_ns, results[i].allocations);
+}
+
+// A bot that turns at random now and then, and away from any snake
+// right ahead of it, which is roughly how people play
+Direction bench_cautious_bot_dir(GameState *game, int player, u64 *random)
+{
+    *random = next_random(*random);
+    if ((*random >> 40) % 8 == 0) {
+        static const Direction dirs[] = {DIR_UP, DIR_DOWN, DIR_LEFT, DIR_RIGHT};
+        return dirs[(*random >> 50) % 4];
+    }
+    return predict_avoiding_snakes(game, player);
+}
+
+typedef struct {
+    float64 hit_rate;
+    float64 resim_per_tick;
+} BenchPredictionResult;
+
+// Plays matches of cautious bots through the rollback code, with the
+// inputs of every bot but the first arriving `delay` frames late, and
+// measures how well the predictor guessed them
+BenchPredictionResult bench_prediction(InputPredictor predictor, int num_snakes, u32 delay, int rounds)
+{
+    static Input trace[4 * MAX_ROLLBACK_FRAMES * MAX_SNAKES];
+    static GameState reference;
+
+    u32 frames_per_round = 4 * MAX_ROLLBACK_FRAMES;
+    u32 len = MIN(4, bench_max_snake_len(num_snakes));
+    u64 random = 1;
+
+    InputPredictor saved_predictor = input_predictor;
+    input_predictor = predictor;
+
+    PredictionStats before[MAX_SNAKES];
+    memcpy(before, prediction_stats, sizeof(before));
+    u64 frames_resimulated_before = rollback_stats.frames_resimulated;
+    u64 frames = 0;
+
+    for (int round = 0; round < rounds; round++) {
+
+        // Record what the bots press when their inputs are on time
+        int num_inputs = 0;
+        bench_setup_snakes(&reference, num_snakes, len);
+        for (u32 f = 0; f < frames_per_round; f++) {
+            for (int p = 0; p < num_snakes; p++) {
+                if (!reference.snakes[p].used) continue;
+                Input input = {.time=f, .player=p, .dir=bench_cautious_bot_dir(&reference, p, &random)};
+                apply_input_to_game_instance(&reference, input);
+                trace[num_inputs++] = input;
+            }
+            update_game_instance(&reference);
+        }
+
+        // Play it back with the remote inputs arriving late
+        input_table_init();
+        bench_setup_snakes(&latest_game_state, num_snakes, len);
+        init_rollback_history();
+
+        for (u32 f = 0, next = 0; f < frames_per_round; f++) {
+            for (int i = next; i < num_inputs; i++) {
+                u32 lag = trace[i].player == 0 ? 0 : delay;
+                if (trace[i].time + lag == f)
+                    apply_input_to_game(trace[i]);
+                if (trace[i].time + delay < f)
+                    next = i + 1;
+            }
+            expire_predictions();
+            recalculate_latest_state();
+            advance_latest_state();
+            frames++;
+        }
+    }
+
+    input_predictor = saved_predictor;
+
+    u64 hits = 0, misses = 0;
+    for (int p = 0; p < MAX_SNAKES; p++) {
+        hits   += prediction_stats[p].hits   - before[p].hits;
+        misses += prediction_stats[p].misses - before[p].misses;
+    }
+
+    BenchPredictionResult result;
+    result.hit_rate = hits + misses ? 100.0 * hits / (hits + misses) : 0;
+    result.resim_per_tick = (float64) (rollback_stats.frames_resimulated - frames_resimulated_before) / frames;
+    return result;
+}
+
+void bench_predictors(int num_snakes)
+{
+    if (num_snakes < 2)
+        return;
+
+    InputPredictor predictors[] = {predict_last_direction, predict_avoiding_snakes};
+    char *names[] = {"last direction", "avoiding snakes"};
+    char *ids[]   = {"last_direction", "avoiding_snakes"};
+    u32 delays[] = {2, 8, 16};
+
+    for (int i = 0; i < COUNTOF(predictors); i++) {
+
+        BenchPredictionResult results[COUNTOF(delays)];
+        for (int j = 0; j < COUNTOF(delays); j++)
+            results[j] = bench_prediction(predictors[i], num_snakes, delays[j], bench_scaled_iterations(50, 1));
+
+        char title[64], bench[64];
+        snprintf(title, sizeof(title), "Predicting %s, hits", names[i]);
+        snprintf(bench, sizeof(bench), "hits_%s", ids[i]);
+        bench_section(title, "delay", "%");
+        for (int j = 0; j < COUNTOF(delays); j++)
+            bench_report(bench, num_snakes, delays[j], "%", results[j].hit_rate, 0);
+
+        snprintf(title, sizeof(title), "Predicting %s, re-simulated", names[i]);
+        snprintf(bench, sizeof(bench), "resim_%s", ids[i]);
+        bench_section(title, "delay", "frames/tick");
+        for (int j = 0; j < COUNTOF(delays); j++)
+            bench_report(bench, num_snakes, delays[j], "frames/tick", results[j].resim_per_tick, 0);
+    }
+}
+
+// Input delay and rollback window picked for connections of growing
+// latency, with jitter at a tenth of the round trip, once they settle
+void bench_rollback_tuning(void)
+{
+    u32 rtts_ms[] = {20, 50, 100, 200, 400, 800};
+    u32 windows[COUNTOF(rtts_ms)], delays[COUNTOF(rtts_ms)];
+
+    u32 saved_window = rollback_window_frames;
+    u32 saved_delay = input_delay_frames;
+    u32 saved_lags[MAX_SNAKES];
+    memcpy(saved_lags, input_lag_frames, sizeof(saved_lags));
+    memset(input_lag_frames, 0, sizeof(input_lag_frames));
+
+    for (int i = 0; i < COUNTOF(rtts_ms); i++) {
+        rollback_window_frames = MAX_ROLLBACK_FRAMES;
+        for (int j = 0; j < MAX_ROLLBACK_FRAMES; j++)
+            tune_rollback_to_latency(rtts_ms[i] * 1000.0, rtts_ms[i] * 100.0);
+        windows[i] = rollback_window_frames;
+        delays[i] = input_delay_frames;
+    }
+
+    rollback_window_frames = saved_window;
+    input_delay_frames = saved_delay;
+    memcpy(input_lag_frames, saved_lags, sizeof(saved_lags));
+
+    bench_section("Rollback window for the latency", "rtt ms", "frames");
+    for (int i = 0; i < COUNTOF(rtts_ms); i++)
+        bench_report("tuned_window", 0, rtts_ms[i], "frames", windows[i], 0);
+
+    bench_section("Input delay for the latency", "rtt ms", "frames");
+    for (int i = 0; i < COUNTOF(rtts_ms); i++)
+        bench_report("tuned_delay", 0, rtts_ms[i], "frames", delays[i], 0);
+}
+
+// Records a long match of cautious bots, where dead snakes are
+// replaced so the board stays busy, then reads random frames back.
+// Checks every frame comes back unchanged.
+void bench_history(int num_snakes)
+{
+    static SnapshotHistory history;
+    u32 num_frames = bench_max_states(10000);
+    GameState *frames = bench_alloc_states(num_frames);
+
+    u32 intervals[] = {16, 64, 256};
+    float64 size[COUNTOF(intervals)], record_ns[COUNTOF(intervals)], read_ns[COUNTOF(intervals)], play_ns[COUNTOF(intervals)];
+    u64 allocs[COUNTOF(intervals)];
+
+    u64 random = 1;
+    batch_init_instance(&frames[0], 1, num_snakes, false);
+    for (u32 f = 1; f < num_frames; f++) {
+        GameState *game = &frames[f];
+        memcpy(game, &frames[f-1], sizeof(GameState));
+        for (int p = 0; p < num_snakes; p++) {
+            if (!game->snakes[p].used)
+                spawn_snake(game);
+            else {
+                Input input = {.time=game->frame_index, .player=p, .dir=bench_cautious_bot_dir(game, p, &random)};
+                apply_input_to_game_instance(game, input);
+            }
+        }
+        update_game_instance(game);
+    }
+
+    for (int i = 0; i < COUNTOF(intervals); i++) {
+
+        u64 allocs_before = bench_allocations();
+        float64 start = os_get_current_time_in_seconds();
+        history_init(&history, &frames[0], intervals[i]);
+        for (u32 f = 1; f < num_frames; f++)
+            history_push(&history, &frames[f]);
+        float64 elapsed = os_get_current_time_in_seconds() - start;
+        allocs[i] = bench_allocations() - allocs_before;
+
+        size[i] = (float64) history_size(&history) / num_frames;
+        record_ns[i] = elapsed * 1e9 / num_frames;
+
+        static GameState game;
+        u32 num_reads = bench_scaled_iterations(2000, 100);
+        start = os_get_current_time_in_seconds();
+        for (u32 r = 0; r < num_reads; r++) {
+            random = next_random(random);
+            u32 f = (random >> 33) % num_frames;
+            history_get(&history, f, &game);
+            assert(!memcmp(&game, &frames[f], sizeof(GameState)), "A frame changed in the history");
+        }
+        read_ns[i] = (os_get_current_time_in_seconds() - start) * 1e9 / num_reads;
+
+        start = os_get_current_time_in_seconds();
+        for (u32 f = 0; f < num_frames; f++)
+            history_get(&history, f, &game);
+        play_ns[i] = (os_get_current_time_in_seconds() - start) * 1e9 / num_frames;
+        assert(!memcmp(&game, &frames[num_frames-1], sizeof(GameState)), "A frame changed in the history");
+
+        history_free(&history);
+    }
+
+    char title[64];
+    snprintf(title, sizeof(title), "State history, %d frames of %d bytes", (int) num_frames, (int) sizeof(GameState));
+    bench_section(title, "keyframes", "bytes/frame");
+    for (int i = 0; i < COUNTOF(intervals); i++)
+        bench_report("history_size", num_snakes, intervals[i], "bytes/frame", size[i], allocs[i]);
+
+    bench_section("State history, compression", "keyframes", "ratio");
+    for (int i = 0; i < COUNTOF(intervals); i++)
+        bench_report("history_ratio", num_snakes, intervals[i], "ratio", sizeof(GameState) / size[i], 0);
+
+    bench_section("State history, recording", "keyframes", "ns/frame");
+    for (int i = 0; i < COUNTOF(intervals); i++)
+        bench_report("history_record", num_snakes, intervals[i], "ns/frame", record_ns[i], 0);
+
+    bench_section("State history, random access", "keyframes", "ns/frame");
+    for (int i = 0; i < COUNTOF(intervals); i++)
+        bench_report("history_read", num_snakes, intervals[i], "ns/frame", read_ns[i], 0);
+
+    bench_section("State history, playback in order", "keyframes", "ns/frame");
+    for (int i = 0; i < COUNTOF(intervals); i++)
+        bench_report("history_play", num_snakes, intervals[i], "ns/frame", play_ns[i], 0);
+
+    dealloc(get_heap_allocator(), frames);
+}
+
+// Records a match of cautious bots, at most max_frames long. Inputs are
+// only recorded when a bot changes direction, like key presses.
+void bench_record_match(ReplayRecorder *rec, u64 seed, int num_snakes, u32 max_frames)
+{
+    static GameState game;
+    batch_init_instance(&game, seed, num_snakes, num_snakes > 1);
+    replay_record_start(rec, &game);
+
+    u64 random = seed;
+    while (!game.game_complete && game.frame_index < max_frames) {
+        for (int p = 0; p < MAX_SNAKES; p++) {
+            if (!game.snakes[p].used) continue;
+            Direction dir = bench_cautious_bot_dir(&game, p, &random);
+            if (dir == game.snakes[p].next_dir) continue;
+            Input input = {.time=game.frame_index, .player=p, .dir=dir};
+            replay_record_input(rec, input);
+            apply_input_to_game_instance(&game, input);
+        }
+        update_game_instance(&game);
+    }
+    replay_record_end(rec, &game);
+}
+
+// Plays a replay and returns the seconds it took, or -1 if it didn't
+// end like it did when it was recorded
+float64 bench_play_replay(u8 *data, u64 size, u64 *frames)
+{
+    static GameState game;
+    ReplayPlayer player;
+    if (!replay_open(&player, data, size, &game))
+        return -1;
+
+    u64 first_frame = game.frame_index;
+    float64 start = os_get_current_time_in_seconds();
+    bool ok = replay_run(&player, &game);
+    float64 elapsed = os_get_current_time_in_seconds() - start;
+
+    *frames = game.frame_index - first_frame;
+    return ok ? elapsed : -1;
+}
+
+// Size of ten minute matches and how fast they play back
+void bench_replays(int num_snakes, char *save_path)
+{
+    static ReplayRecorder recs[16];
+
+    u32 max_frames = 10 * 60 * FPS;
+    u64 bytes = 0, event_bytes = 0, frames = 0;
+    for (int i = 0; i < COUNTOF(recs); i++) {
+        bench_record_match(&recs[i], 1 + i, num_snakes, max_frames);
+        bytes += replay_size(&recs[i]);
+        event_bytes += recs[i].events_size;
+    }
+
+    if (save_path) {
+        string data = {.count=replay_size(&recs[0]), .data=replay_data(&recs[0])};
+        if (!os_write_entire_file_s(STR(save_path), data))
+            printf("Couldn't write %cs\n", save_path);
+    }
+
+    float64 elapsed = 0;
+    u64 allocs_before = bench_allocations();
+    for (int run = 0; run < 20; run++) {
+        for (int i = 0; i < COUNTOF(recs); i++) {
+            u64 n;
+            float64 t = bench_play_replay(replay_data(&recs[i]), replay_size(&recs[i]), &n);
+            assert(t >= 0, "A replay didn't end like its match");
+            elapsed += t;
+            frames += n;
+        }
+    }
+    u64 allocs = bench_allocations() - allocs_before;
+
+    // Matches between bots may end before ten minutes
+    float64 minutes = (float64) frames / 20 / FPS / 60;
+
+    bench_section("Replays", "keyframes", "bytes/min");
+    bench_report("replay_size", num_snakes, 0, "bytes/min", event_bytes / minutes, 0);
+    bench_report("replay_size", num_snakes, REPLAY_KEYFRAME_INTERVAL, "bytes/min", bytes / minutes, 0);
+
+    bench_section("Replay playback", "matches", "Mticks/s");
+    bench_report("replay_speed", num_snakes, COUNTOF(recs), "Mticks/s", frames / elapsed / 1e6, allocs);
+
+    // Seeking to random frames, by playing from the start and from the
+    // closest keyframe
+    static GameState game;
+    float64 seek_us[2] = {0};
+    u64 random = 1;
+    int num_seeks = 0;
+    for (int i = 0; i < COUNTOF(recs); i++) {
+        ReplayPlayer player;
+        bool ok = replay_open(&player, replay_data(&recs[i]), replay_size(&recs[i]), &game);
+        assert(ok && player.num_keyframes > 0, "A replay has no index");
+        u64 first_frame = game.frame_index;
+        u64 length = player.index_end_frame - first_frame;
+
+        for (int k = 0; k < 32; k++) {
+            random = next_random(random);
+            u64 target = first_frame + (random >> 33) % (length + 1);
+
+            float64 start = os_get_current_time_in_seconds();
+            ok = replay_open(&player, replay_data(&recs[i]), replay_size(&recs[i]), &game)
+              && replay_play_until(&player, &game, target);
+            seek_us[0] += (os_get_current_time_in_seconds() - start) * 1e6;
+            assert(ok && game.frame_index == target, "Couldn't play to a frame");
+            u64 hash = game.hash;
+
+            start = os_get_current_time_in_seconds();
+            ok = replay_seek(&player, target, &game);
+            seek_us[1] += (os_get_current_time_in_seconds() - start) * 1e6;
+            assert(ok && game.frame_index == target && game.hash == hash, "Seeking didn't land on the played frame");
+
+            // Playing on from a keyframe must end the same
+            if (k == 0)
+                assert(replay_run(&player, &game), "A match seeked into ended differently");
+            num_seeks++;
+        }
+    }
+
+    bench_section("Replay seeking", "keyframes", "us/seek");
+    bench_report("replay_seek", num_snakes, 0, "us/seek", seek_us[0] / num_seeks, 0);
+    bench_report("replay_seek", num_snakes, REPLAY_KEYFRAME_INTERVAL, "us/seek", seek_us[1] / num_seeks, 0);
+}
+
+// Plays a replay file as fast as possible, for regression runs.
+// Returns 0 if the match ended like it did when it was recorded.
+int bench_replay_file(char *path)
+{
+    string data;
+    if (!os_read_entire_file_s(STR(path), &data, get_heap_allocator())) {
+        printf("Couldn't read %cs\n", path);
+        return 1;
+    }
+
+    u64 frames;
+    float64 elapsed = bench_play_replay(data.data, data.count, &frames);
+    dealloc(get_heap_allocator(), data.data);
+
+    if (elapsed < 0) {
+        printf("%cs: the replay is malformed, for another world size, or didn't end like its match\n", path);
+        return 1;
+    }
+    printf("%cs: %d frames in %.3f ms, %.2f Mticks/s\n", path, (int) frames, elapsed * 1e3, frames / elapsed / 1e6);
+    return 0;
+}
+
+// Bots that turn in a random direction every few frames. Each
+// instance has its own random state, as batch input procs may only
+// touch data of their own instance.
+int bench_random_bot_inputs(void *user_data, u32 instance, GameState *game, Input *inputs, int max_inputs)
+{
+    u64 *random = &((u64*) user_data)[instance];
+
+    int num_inputs = 0;
+    for (int i = 0; i < MAX_SNAKES && num_inputs < max_inputs; i++) {
+        if (!game->snakes[i].used) continue;
+
+        *random = next_random(*random);
+        if ((*random >> 40) % 4) continue;
+
+        static const Direction dirs[] = {DIR_UP, DIR_DOWN, DIR_LEFT, DIR_RIGHT};
+        inputs[num_inputs++] = (Input) {.time=game->frame_index, .player=i, .dir=dirs[(*random >> 50) % 4]};
+    }
+    return num_inputs;
+}
+
+// Throughput of whole matches between random bots as the number of
+// worker threads grows
+void bench_batch(int num_snakes, int max_workers)
+{
+    static u64 bot_random[4096];
+    static Batch batch;
+    u32 num_instances = bench_max_states(COUNTOF(bot_random));
+    GameState *instances = bench_alloc_states(num_instances);
+
+    bench_section("Batched matches", "workers", "ns/tick");
+
+    // Instances don't depend on each other, so the outcome must be the
+    // same for any number of workers
+    u64 expected_frames = 0;
+    u64 expected_hash = 0;
+
+    for (int num_workers = 1; num_workers <= max_workers; num_workers *= 2) {
+
+        for (u32 i = 0; i < num_instances; i++) {
+            batch_init_instance(&instances[i], 1 + i, num_snakes, num_snakes > 1);
+            bot_random[i] = 1 + i;
+        }
+        batch_init(&batch, instances, num_instances, num_workers, bench_random_bot_inputs, bot_random);
+
+        u64 allocs_before = bench_allocations();
+        float64 start = os_get_current_time_in_seconds();
+        u64 frames = batch_run(&batch, 1000);
+        float64 elapsed = os_get_current_time_in_seconds() - start;
+        u64 allocs = bench_allocations() - allocs_before;
+
+        u64 hash = 0;
+        for (u32 i = 0; i < num_instances; i++)
+            hash = hash * 31 + instances[i].hash;
+
+        if (num_workers == 1) {
+            expected_frames = frames;
+            expected_hash = hash;
+        }
+        assert(frames == expected_frames && hash == expected_hash, "Batched matches depend on the number of workers");
+
+        bench_report("batch", num_snakes, num_workers, "ns/tick", elapsed * 1e9 / frames, allocs);
+
+        if (num_workers < max_workers && num_workers * 2 > max_workers)
+            num_workers = max_workers / 2; // Always end with max_workers
+    }
+
+    dealloc(get_heap_allocator(), instances);
+}
+
+#if HAVE_MULTIPLAYER
+
+// Connects the clients to the server net.c listens on and waits for
+// it to accept all of them. Gives up after a few seconds.
+bool bench_connect_clients(Transport **clients, int num_clients, u64 server_id)
+{
+    if (!start_waiting_for_players(num_clients))
+        return false;
+    for (int i = 0; i < num_clients; i++)
+        if (!clients[i]->connect_start(clients[i], server_id))
+            return false;
+
+    float64 start = os_get_current_time_in_seconds();
+    while (os_get_current_time_in_seconds() - start < 5) {
+        net_update();
+        bool connected = wait_for_players();
+        for (int i = 0; i < num_clients; i++) {
+            clients[i]->update(clients[i]);
+            connected = connected && clients[i]->connect_status(clients[i]) == CONNECT_OK;
+        }
+        if (connected) return true;
+        os_yield_thread();
+    }
+    return false;
+}
+
+// Receives and drops whatever the server sent to a client, but the
+// acks of its input packets. Returns the number of bytes.
+u64 bench_drain_client(Transport *client, InputChannel *inputs)
+{
+    u64 bytes = 0;
+    NetMessage msgs[NET_RECEIVE_BATCH];
+    Input received[INPUT_REDUNDANCY];
+    int n;
+    client->update(client);
+    while ((n = client->receive(client, NET_HANDLE_SERVER, msgs, COUNTOF(msgs))) > 0) {
+        for (int i = 0; i < n; i++) {
+            bytes += msgs[i].size;
+            if (msgs[i].data[0] == MESSAGE_INPUTS)
+                assert(input_channel_read_packet(inputs, msgs[i].data, msgs[i].size, received) >= 0, "Malformed input packet from the server");
+        }
+        client->release(client, msgs, n);
+    }
+    return bytes;
+}
+
+// Sends a client's input packet, what client_update does. Returns the
+// number of bytes.
+u64 bench_send_client_inputs(Transport *client, InputChannel *inputs)
+{
+    u8 packet[INPUT_PACKET_MAX_SIZE];
+    int size = input_channel_write_packet(inputs, packet);
+    if (size > 0)
+        client->send_unreliable(client, NET_HANDLE_SERVER, packet, size);
+    return size;
+}
+
+bool bench_inputs_acked(InputChannel *inputs, int num_clients)
+{
+    for (int c = 0; c < num_clients; c++)
+        if (input_channel_num_unacked(&inputs[c]) > 0 || input_channel_num_unacked(&client_data[c].inputs) > 0)
+            return false;
+    return true;
+}
+
+// Closes the connections without the logging of net_reset and frees
+// the server transport
+void bench_disconnect_clients(void)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_data[i].handle != NET_HANDLE_INVALID)
+            net_transport->close_accepted_connection(net_transport, client_data[i].handle);
+        client_data[i].handle = NET_HANDLE_INVALID;
+        reset_client_data(&client_data[i]);
+    }
+    reset_client_data(&server_data);
+    num_players_to_wait = -1;
+    net_free();
+}
+
+// Lets the messages still on their way from an earlier run arrive and
+// drops them, so they don't land in the next match. Input packets go
+// on until every input was acknowledged.
+void bench_flush_network(Transport **clients, InputChannel *inputs, int num_clients)
+{
+    for (int round = 0; round < 3 || !loopback_links_idle() || !bench_inputs_acked(inputs, num_clients); round++) {
+        assert(round < 10000, "The network didn't settle");
+        Input input;
+        for (int c = 0; c < num_clients; c++)
+            bench_send_client_inputs(clients[c], &inputs[c]);
+        net_update();
+        while (get_client_input_from_network(&input));
+        for (int c = 0; c < num_clients; c++)
+            bench_drain_client(clients[c], &inputs[c]);
+        loopback_time++;
+    }
+}
+
+// Input messages as they were before the protocol had a version:
+// type, frame (u64), player (u32) and direction (u32) in network
+// order. Clients left the player out.
+int bench_encode_fixed_input(u8 *dst, Input input, bool with_player)
+{
+    u64 time = htonll(input.time);
+    u32 player = htonl(input.player);
+    u32 dir = htonl(input.dir);
+    u8 *p = dst;
+    *p++ = MESSAGE_INPUT;
+    memcpy(p, &time, sizeof(time));
+    p += sizeof(time);
+    if (with_player) {
+        memcpy(p, &player, sizeof(player));
+        p += sizeof(player);
+    }
+    memcpy(p, &dir, sizeof(dir));
+    return p + sizeof(dir) - dst;
+}
+
+int bench_decode_fixed_input(u8 *src, Input *input, bool with_player)
+{
+    u64 time;
+    u32 player = 0, dir;
+    u8 *p = src + 1;
+    memcpy(&time, p, sizeof(time));
+    p += sizeof(time);
+    if (with_player) {
+        memcpy(&player, p, sizeof(player));
+        p += sizeof(player);
+    }
+    memcpy(&dir, p, sizeof(dir));
+    *input = (Input) {.time=ntohll(time), .player=ntohl(player), .dir=ntohl(dir)};
+    return p + sizeof(dir) - src;
+}
+
+typedef struct {
+    double ns_per_message;
+    double bytes_per_second;
+} BenchWireResult;
+
+// Encodes, then decodes, the input messages of relaying the inputs of
+// num_snakes snakes for a number of frames: every client sends its
+// input to the server, which sends every input to every client. The
+// inputs of a frame are up to 3 frames late, as they are when they
+// come from players with different latencies. version 0 is the fixed
+// layout of before.
+BenchWireResult bench_wire_inputs(int version, int num_snakes)
+{
+    int num_clients = MAX(1, num_snakes - 1);
+    int per_frame = num_clients * (1 + num_snakes);
+    int frames = MAX(1, 100000 / per_frame);
+    int num_messages = frames * per_frame;
+
+    // Each message goes over a connection one way, a stream, which
+    // has the frame its deltas count from at both ends
+    u8 *buffer = alloc(get_heap_allocator(), (u64) num_messages * PROTOCOL_MAX_MESSAGE_SIZE);
+    u16 *streams = alloc(get_heap_allocator(), (u64) num_messages * sizeof(u16));
+    Input *inputs = alloc(get_heap_allocator(), (u64) num_messages * sizeof(Input));
+    assert(buffer && streams && inputs, "Out of memory for the codec benchmark");
+    u64 send_frames[2 * MAX_SNAKES] = {0};
+    u64 recv_frames[2 * MAX_SNAKES] = {0};
+
+    int n = 0;
+    for (int f = 0; f < frames; f++) {
+        for (int p = 0; p < num_snakes; p++) {
+            Input input = {.time=MAX(0, f - p % 4), .player=p, .dir=bench_path_dir(f + p)};
+            if (p > 0) {
+                streams[n] = p - 1; // Client to server
+                inputs[n++] = (Input) {.time=input.time, .dir=input.dir};
+            }
+            for (int c = 0; c < num_clients; c++) {
+                streams[n] = num_clients + c; // Server to client
+                inputs[n++] = input;
+            }
+        }
+    }
+
+    float64 start = os_get_current_time_in_seconds();
+    u8 *p = buffer;
+    for (int i = 0; i < num_messages; i++) {
+        bool to_client = streams[i] >= num_clients;
+        if (version == 0)
+            p += bench_encode_fixed_input(p, inputs[i], to_client);
+        else {
+            ProtocolMessage msg = {.type=MESSAGE_INPUT, .frame_index=inputs[i].time, .player=inputs[i].player, .dir=inputs[i].dir};
+            p += encode_message(p, &send_frames[streams[i]], &msg);
+        }
+    }
+    u64 bytes = p - buffer;
+
+    u8 *end = p;
+    p = buffer;
+    for (int i = 0; i < num_messages; i++) {
+        bool to_client = streams[i] >= num_clients;
+        Input input;
+        if (version == 0)
+            p += bench_decode_fixed_input(p, &input, to_client);
+        else {
+            ProtocolMessage msg;
+            p += decode_message(p, end - p, &recv_frames[streams[i]], &msg);
+            input = (Input) {.time=msg.frame_index, .player=msg.player, .dir=msg.dir};
+        }
+        assert(input.time == inputs[i].time && input.player == inputs[i].player && input.dir == inputs[i].dir, "An input didn't survive the wire format");
+    }
+    float64 elapsed = os_get_current_time_in_seconds() - start;
+    assert(p == end, "The wire format decoded a different stream");
+
+    dealloc(get_heap_allocator(), buffer);
+    dealloc(get_heap_allocator(), streams);
+    dealloc(get_heap_allocator(), inputs);
+
+    BenchWireResult result;
+    result.ns_per_message = elapsed * 1e9 / num_messages;
+    result.bytes_per_second = (double) bytes / frames * FPS;
+    return result;
+}
+
+void bench_wire_format(int num_snakes)
+{
+    int versions[] = {0, NET_PROTOCOL_VERSION};
+    BenchWireResult results[COUNTOF(versions)];
+    for (int i = 0; i < COUNTOF(versions); i++)
+        results[i] = bench_wire_inputs(versions[i], num_snakes);
+
+    bench_section("Input messages, encoding and decoding", "version", "ns/msg");
+    for (int i = 0; i < COUNTOF(versions); i++)
+        bench_report("wire_codec", num_snakes, versions[i], "ns/msg", results[i].ns_per_message, 0);
+
+    bench_section("Input messages, relay traffic", "version", "bytes/s");
+    for (int i = 0; i < COUNTOF(versions); i++)
+        bench_report("wire_bytes", num_snakes, versions[i], "bytes/s", results[i].bytes_per_second, 0);
+}
+
+typedef struct {
+    double frame_ns;
+    double bytes_per_frame;
+    double rollback_depth; // Mean frames resimulated by a rollback
+    u64 allocations;
+} BenchNetResult;
+
+// How one run sends the inputs. The link only applies to loopback,
+// where it's set on every endpoint.
+typedef struct {
+    u32 delay;
+    LoopbackLink link;
+    bool redundant;
+} BenchNetRun;
+
+// The rollback benchmark with the remote inputs going through net.c.
+// This process is the server, the clients are bare transport endpoints
+// that send the input messages of their snake `delay` frames late and
+// drain what the server relays to them. The time is that of whole
+// frames, clients included, and the bytes are the payloads sent both
+// ways.
+BenchNetResult bench_net_frames(Transport **clients, u64 *client_frames, InputChannel *client_inputs, int num_snakes, u32 delay, int frames)
+{
+    u32 len = MIN(8, bench_max_snake_len(num_snakes));
+
+    bench_flush_network(clients, client_inputs, num_snakes-1);
+    send_initial_state();
+    input_table_init();
+    bench_setup_snakes(&latest_game_state, num_snakes, len);
+    init_rollback_history();
+    for (int c = 0; c < num_snakes-1; c++)
+        bench_drain_client(clients[c], &client_inputs[c]);
+
+    u64 bytes = 0;
+    u64 allocs_before = bench_allocations();
+    u64 resimulated_before = rollback_stats.frames_resimulated;
+    u64 rollbacks_before = rollback_stats.rollbacks;
+    float64 start = os_get_current_time_in_seconds();
+
+    for (u32 f = 0; f < frames; f++) {
+
+        for (int c = 0; c < num_snakes-1; c++) {
+            u32 p = c + 1;
+            if (f >= delay) {
+                u64 time = f - delay;
+                u32 head = p * (len + 1) + len - 1;
+                Direction dir = bench_path_dir(head + time);
+
+                // What send_local_input sends
+                if (redundant_inputs)
+                    input_channel_push(&client_inputs[c], (Input) {.time=time, .dir=dir});
+                else {
+                    u8 msg[PROTOCOL_MAX_MESSAGE_SIZE];
+                    ProtocolMessage input = {.type=MESSAGE_INPUT, .frame_index=time, .dir=dir};
+                    int size = encode_message(msg, &client_frames[c], &input);
+                    clients[c]->send(clients[c], NET_HANDLE_SERVER, msg, size);
+                    bytes += size;
+                }
+            }
+            bytes += bench_send_client_inputs(clients[c], &client_inputs[c]);
+        }
+
+        net_update();
+
+        Input input = {.time=f, .player=0, .dir=bench_path_dir(len - 1 + f)};
+        apply_input_to_game(input);
+        send_local_input(input);
+        while (get_client_input_from_network(&input))
+            apply_input_to_game(input);
+
+        expire_predictions();
+        recalculate_latest_state();
+        advance_latest_state();
+
+        for (int c = 0; c < num_snakes-1; c++)
+            bytes += bench_drain_client(clients[c], &client_inputs[c]);
+        loopback_time++;
+    }
+
+    BenchNetResult result;
+    result.frame_ns = (os_get_current_time_in_seconds() - start) * 1e9 / frames;
+    result.bytes_per_frame = (double) bytes / frames;
+    u64 rollbacks = rollback_stats.rollbacks - rollbacks_before;
+    result.rollback_depth = rollbacks ? (double) (rollback_stats.frames_resimulated - resimulated_before) / rollbacks : 0;
+    result.allocations = bench_allocations() - allocs_before;
+    return result;
+}
+
+enum {
+    BENCH_LOOPBACK,
+    BENCH_UDP,
+};
+
+// Sets up a server and its clients on a transport and does the runs.
+// Returns false if the transport couldn't connect.
+bool bench_net_transport(int kind, int num_snakes, BenchNetRun *runs, int num_runs, BenchNetResult *results)
+{
+    static LoopbackTransport loopback_server;
+    static UdpTransport udp_server;
+    int num_clients = num_snakes - 1;
+
+    Transport *server;
+    u64 server_id;
+    if (kind == BENCH_LOOPBACK) {
+        loopback_transport_init(&loopback_server, 0);
+        server = &loopback_server.base;
+        server_id = 0;
+    } else {
+        if (!udp_transport_init(&udp_server, 0))
+            return false;
+        server = &udp_server.base;
+        server_id = udp_peer_id(0x7F000001, udp_transport_port(&udp_server)); // 127.0.0.1
+    }
+
+    u64 endpoint_size = kind == BENCH_LOOPBACK ? sizeof(LoopbackTransport) : sizeof(UdpTransport);
+    u8 *endpoints = alloc(get_heap_allocator(), MAX(1, num_clients) * endpoint_size);
+    Transport *clients[MAX_CLIENTS];
+    assert(endpoints, "Out of memory for the benchmark clients");
+
+    bool ok = true;
+    for (int i = 0; i < num_clients; i++) {
+        clients[i] = (Transport*) (endpoints + i * endpoint_size);
+        if (kind == BENCH_LOOPBACK)
+            loopback_transport_init((LoopbackTransport*) clients[i], 1 + i);
+        else if (!udp_transport_init((UdpTransport*) clients[i], 0)) {
+            num_clients = i;
+            ok = false;
+            break;
+        }
+    }
+
+    net_init(server);
+    is_server = true;
+    multiplayer = true;
+
+    // Frames the deltas of the clients' input messages count from, and
+    // the input packets they send
+    u64 client_frames[MAX_CLIENTS] = {0};
+    InputChannel client_inputs[MAX_CLIENTS];
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        input_channel_init(&client_inputs[i]);
+
+    bool redundant = redundant_inputs;
+    if (ok && bench_connect_clients(clients, num_clients, server_id)) {
+        int frames = bench_scaled_iterations(2000, 4 * MAX_ROLLBACK_FRAMES);
+        for (int i = 0; i < num_runs; i++) {
+            if (kind == BENCH_LOOPBACK) {
+                loopback_server.link = runs[i].link;
+                for (int c = 0; c < num_clients; c++)
+                    ((LoopbackTransport*) clients[c])->link = runs[i].link;
+            }
+            redundant_inputs = runs[i].redundant;
+            results[i] = bench_net_frames(clients, client_frames, client_inputs, num_snakes, runs[i].delay, frames);
+        }
+    } else
+        ok = false;
+
+    redundant_inputs = redundant;
+    is_server = false;
+    multiplayer = false;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        input_channel_reset(&client_inputs[i]);
+    bench_disconnect_clients();
+    for (int i = 0; i < num_clients; i++)
+        clients[i]->free(clients[i]);
+    dealloc(get_heap_allocator(), endpoints);
+    return ok;
+}
+
+void bench_network(int num_snakes)
+{
+    u32 delays[] = {0, 4, 16};
+    BenchNetRun runs[COUNTOF(delays)];
+    BenchNetResult results[2][COUNTOF(delays)];
+    bool ok[2];
+
+    // One snake has nobody to talk to
+    num_snakes = MAX(2, num_snakes);
+
+    for (int i = 0; i < COUNTOF(delays); i++)
+        runs[i] = (BenchNetRun) {.delay=delays[i], .redundant=redundant_inputs};
+    ok[0] = bench_net_transport(BENCH_LOOPBACK, num_snakes, runs, COUNTOF(runs), results[0]);
+    ok[1] = bench_net_transport(BENCH_UDP,      num_snakes, runs, COUNTOF(runs), results[1]);
+
+    char *titles[] = {"Relayed inputs over loopback", "Relayed inputs over UDP"};
+    char *benches[] = {"net_loopback", "net_udp"};
+    for (int k = 0; k < 2; k++) {
+        bench_section(titles[k], "delay", "ns/frame");
+        if (!ok[k]) {
+            if (!bench_machine_readable)
+                printf("Couldn't connect the clients\n");
+            continue;
+        }
+        for (int i = 0; i < COUNTOF(delays); i++)
+            bench_report(benches[k], num_snakes, delays[i], "ns/frame", results[k][i].frame_ns, results[k][i].allocations);
+    }
+
+    if (ok[0]) {
+        bench_section("Relayed inputs, traffic", "delay", "bytes/frame");
+        for (int i = 0; i < COUNTOF(delays); i++)
+            bench_report("net_bytes", num_snakes, delays[i], "bytes/frame", results[0][i].bytes_per_frame, 0);
+    }
+}
+
+// Inputs sent reliably and in redundant packets over a lossy loopback
+// link, 2 frames each way and a lost reliable message resent after 5
+// frames. A reliable input that's lost holds up the ones after it, so
+// the server rolls back further than the latency alone makes it.
+void bench_lossy_network(int num_snakes)
+{
+    u32 loss_percents[] = {0, 1, 2, 3, 5};
+    BenchNetRun runs[2 * COUNTOF(loss_percents)];
+    BenchNetResult results[COUNTOF(runs)];
+
+    num_snakes = MAX(2, num_snakes);
+
+    for (int i = 0; i < COUNTOF(runs); i++) {
+        LoopbackLink link = {.loss=loss_percents[i/2] / 100.0, .latency=2, .resend_interval=5};
+        runs[i] = (BenchNetRun) {.link=link, .redundant=i % 2};
+    }
+    if (!bench_net_transport(BENCH_LOOPBACK, num_snakes, runs, COUNTOF(runs), results))
+        return;
+
+    char *titles[] = {"Reliable inputs over a lossy link", "Redundant inputs over a lossy link"};
+    char *depth_benches[] = {"lossy_reliable_depth", "lossy_redundant_depth"};
+    char *bytes_benches[] = {"lossy_reliable_bytes", "lossy_redundant_bytes"};
+    for (int k = 0; k < 2; k++) {
+        char title[64];
+        snprintf(title, sizeof(title), "%s, rollback depth", titles[k]);
+        bench_section(title, "loss %", "frames");
+        for (int i = k; i < COUNTOF(runs); i += 2)
+            bench_report(depth_benches[k], num_snakes, loss_percents[i/2], "frames", results[i].rollback_depth, 0);
+
+        snprintf(title, sizeof(title), "%s, traffic", titles[k]);
+        bench_section(title, "loss %", "bytes/frame");
+        for (int i = k; i < COUNTOF(runs); i += 2)
+            bench_report(bytes_benches[k], num_snakes, loss_percents[i/2], "bytes/frame", results[i].bytes_per_frame, 0);
+    }
+}
+
+#endif /* HAVE_MULTIPLAYER */
+
+int bench_entry(int argc, char **argv)
+{
+    int num_snakes = MAX_SNAKES;
+    int max_workers = 1;
+    char *replay_save_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-m"))
+            bench_machine_readable = true;
+        else if (!strcmp(argv[i], "-s") && i+1 < argc)
+            num_snakes = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-j") && i+1 < argc)
+            max_workers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-w") && i+1 < argc)
+            replay_save_path = argv[++i];
+        else if (!strcmp(argv[i], "-r") && i+1 < argc)
+            return bench_replay_file(argv[++i]);
+        else {
+            printf("Usage: %cs [-m] [-s <snakes>] [-j <workers>] [-w <replay>] [-r <replay>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_snakes < 1 || num_snakes > MAX_SNAKES) {
+        printf("The snake count must be between 1 and %d\n", MAX_SNAKES);
+        return 1;
+    }
+
+    if (max_workers < 1 || max_workers > MAX_BATCH_WORKERS) {
+        printf("The worker count must be between 1 and %d\n", MAX_BATCH_WORKERS);
+        return 1;
+    }
+
+    multiplayer = false;
+    bench_collisions(num_snakes);
+    bench_apple_spawning();
+    bench_state_copy(num_snakes);
+    bench_rollbacks(num_snakes);
+    bench_predictors(num_snakes);
+    bench_rollback_tuning();
+    bench_history(num_snakes);
+    bench_replays(num_snakes, replay_save_path);
+    bench_batch(num_snakes, max_workers);
+#if HAVE_MULTIPLAYER
+    bench_wire_format(num_snakes);
+    bench_network(num_snakes);
+    bench_lossy_network(num_snakes);
+#endif
+    return 0;
+}
@@ -57,6 +57,7 @@ bool byte_queue_ensure_min_free_space(ByteQueue *q, size_t num)
             if (q->data)
                 dealloc(get_heap_allocator(), q->data);
             q->data = data;
+            q->head = 0;
             q->capacity = capacity;
 
         } else {
@@ -2,16 +2,60 @@
 #define FPS 10
 #define TILE_W 16
 #define TILE_H 16
+#define TCP_PORT 8080
+#define INPUT_FRAME_DELAY_COUNT 1 // Least input delay, the one used until the latency is measured
+#define MAX_INPUT_DELAY_FRAMES 4
+#define MAX_ROLLBACK_FRAMES 32
+#define MIN_ROLLBACK_FRAMES 4
+#define ROLLBACK_LATENCY_FRAMES 2 // One-way latency hidden by rolling back, the rest is input delay
+#define PING_INTERVAL 0.5 // Seconds
+#define NET_RECEIVE_BATCH 16 // Most messages taken off a connection at once
+#define INPUT_REDUNDANCY 64 // Most inputs an unreliable input packet repeats
+#define REPLAY_PATH "last_match.snkr" // Where the replay of the last match is saved
+#define REPLAY_KEYFRAME_INTERVAL 300 // Most frames simulated to seek in a replay
+#define INPUT_WINDOW_LOG2 7
+#define INPUT_WINDOW (1 << INPUT_WINDOW_LOG2)
+
+// The world size, snake and apple counts can be overridden from the
+// command line, which the headless build uses to benchmark other sizes.
+#ifndef WORLD_W
 #define WORLD_W 20
+#endif
+
+#ifndef WORLD_H
 #define WORLD_H 20
+#endif
+
+// Largest world a match can be set up with, see init_game_state_sized.
+// The GameState is sized for it, matches default to WORLD_W x WORLD_H.
+#ifndef MAX_WORLD_W
+#define MAX_WORLD_W WORLD_W
+#endif
+
+#ifndef MAX_WORLD_H
+#define MAX_WORLD_H WORLD_H
+#endif
+
+#ifndef MAX_SNAKES
 #define MAX_SNAKES 8
+#endif
+
+#ifndef MAX_APPLES
 #define MAX_APPLES 4
-#define TCP_PORT 8080
-#define MAX_INPUTS_LOG2 10
-#define INPUT_FRAME_DELAY_COUNT 1
-#define MAX_INPUTS (1 << MAX_INPUTS_LOG2)
-#define MAX_SNAKE_SIZE (WORLD_W * WORLD_H)
+#endif
+
+// Keep the rollback history as an undo log of the fields that changed
+// instead of a copy of the whole state per frame
+#ifndef ROLLBACK_UNDO_LOG
+#define ROLLBACK_UNDO_LOG 0
+#endif
 
 #ifndef HAVE_MULTIPLAYER
 #define HAVE_MULTIPLAYER 1
+#endif
+
+// Multiplayer builds without Steam only have the loopback and UDP
+// transports, see transport.c
+#ifndef HAVE_STEAM
+#define HAVE_STEAM HAVE_MULTIPLAYER
 #endif
\ No newline at end of file
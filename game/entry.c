@@ -183,7 +183,7 @@ void create_lobby_loop(void)
 
 		case 1:
 		{
-			input_queue_init();
+			input_table_init();
 			if (!start_waiting_for_players(num_players__-1)) {
 				abort();
 				// TODO: An error occurred
@@ -359,7 +359,7 @@ void joining_lobby_loop(void)
 		{
 			uint64_t peer_id = steam_current_lobby_owner();
 			if (net_connect_start(peer_id)) {
-				input_queue_init();
+				input_table_init();
 				is_server = false;
 				multiplayer = true;
 				current_view = VIEW_CONNECTING;
@@ -392,14 +392,14 @@ void main_menu_loop(void)
     if (draw_menu(entries, COUNTOF(entries), &cursor)) {
         switch (cursor) {
             case 0: /* PLAY */
-            input_queue_init();
+            input_table_init();
 			input_globals_init();
-            init_game_state(&latest_game_state);
+            init_game_state(&latest_game_state, false);
             is_server = true;
             multiplayer = false;
             self_snake_index = 0;
             spawn_snake(&latest_game_state);
-			memcpy(&oldest_game_state, &latest_game_state, sizeof(GameState));
+			init_rollback_history();
             current_view = VIEW_PLAY;
             break;
             case 1: /* HOST */
@@ -540,6 +540,8 @@ void play_loop(void)
 		else {
 			float elapsed_since_complete = current_time - game_complete_time;
 			if (elapsed_since_complete > 1) {
+				if (!save_match_replay(REPLAY_PATH))
+					printf("Couldn't save the replay to %cs\n", REPLAY_PATH);
 				switch (game_result()) {
 					case GAME_RESULT_WIN: current_view = VIEW_YOU_WIN;   break;
 					case GAME_RESULT_LOSE: current_view = VIEW_YOU_LOSE; break;
@@ -558,7 +560,9 @@ void play_loop(void)
 void prelude(void)
 {
 #if HAVE_MULTIPLAYER
-	net_init();
+	static Transport steam_transport;
+	steam_transport_init(&steam_transport);
+	net_init(&steam_transport);
 #endif
 }
 
@@ -680,6 +684,20 @@ int entry(int argc, char **argv)
 		{
 			string text = tprint("FPS %2.2f", 1/last_frame_time);
 			draw_horizontally_centered_text(text, 24, 0);
+
+			if (current_view == VIEW_PLAY) {
+				text = tprint("RESIM %d/s ROLLBACKS %d/s", (int) rollback_stats.frames_resimulated_per_second, (int) rollback_stats.rollbacks_per_second);
+				draw_horizontally_centered_text(text, 24, 24);
+
+#if HAVE_MULTIPLAYER
+				if (multiplayer) {
+					RttEstimate rtt;
+					get_connection_rtt(&rtt);
+					text = tprint("RTT %d ms JITTER %d ms WINDOW %d DELAY %d", (int) (rtt.srtt_us / 1000), (int) (rtt.jitter_us / 1000), (int) rollback_window_frames, (int) input_delay_frames);
+					draw_horizontally_centered_text(text, 24, 48);
+				}
+#endif
+			}
 		}
 
         os_update();
@@ -1,38 +1,139 @@
 #define SPRITE_W 8
 #define SPRITE_H 8
 
+#define MAX_CELLS (MAX_WORLD_W * MAX_WORLD_H)
+
+_Static_assert(WORLD_W <= MAX_WORLD_W && WORLD_H <= MAX_WORLD_H, "The default world doesn't fit the largest one");
+
 typedef struct {
     bool used;
     Direction dir, next_dir;
     u32 head_x;
     u32 head_y;
-    u32 body_idx;
+    u32 tail_x;
+    u32 tail_y;
     u32 body_len;
-    Direction body[MAX_SNAKE_SIZE];
 
-    // Iterator state is embedded in the snake
-    u32 iter_index;
-    u32 iter_x;
-    u32 iter_y;
+    // Directions of the body, newest first, in chunks from the body
+    // pool of the GameState. Walk them with a SnakeIter and change
+    // them with push_body_dir and pop_body_dir.
+    u32 head_chunk; // Chunk of the newest direction, NO_CHUNK if none
+    u32 head_pos;   // Position of the newest direction in its chunk
+    u32 tail_chunk; // Chunk of the oldest direction
+    u32 tail_pos;
 } Snake;
 
+/*
+ * Snake bodies are deques of fixed size chunks linked from the head
+ * to the tail. Moving forwards stores a direction at the head end and
+ * drops one at the tail end, and both ends walk their chunk from the
+ * last position to the first. So a body chunk is only allocated every
+ * BODY_CHUNK_DIRS moves and the pool is sized by the world rather
+ * than by the longest snake times the number of snakes.
+ */
+#define BODY_CHUNK_DIRS 64
+#define NO_CHUNK ((u32) -1)
+
+typedef struct {
+    u8  dirs[BODY_CHUNK_DIRS / 4]; // Packed 2 bits each
+    u32 next; // Chunk closer to the tail, or the next free chunk
+    u32 prev; // Chunk closer to the head
+} BodyChunk;
+
+// Segments fit the world but for the heads of colliding snakes, and a
+// body only has partly used chunks at its two ends.
+#define MAX_BODY_CHUNKS ((MAX_CELLS + MAX_SNAKES) / BODY_CHUNK_DIRS + 2 * MAX_SNAKES)
+
+// Cells touched by a single move of a snake. The head always enters
+// a new cell, while the tail only leaves one if the snake didn't grow.
+typedef struct {
+    bool grew;
+    u32  entered_x;
+    u32  entered_y;
+    bool left_cell;
+    u32  left_x;
+    u32  left_y;
+} SnakeStep;
+
 typedef struct {
-    bool used;
     u32 x;
     u32 y;
 } Apple;
 
+/*
+ * Occupancy of a world cell. The low bits count how many snake
+ * segments lie on the cell. If there are any, the high bits hold the
+ * index of the last snake that entered it, otherwise the index of the
+ * apple on the cell plus one, or 0 when it's empty. Cells are only
+ * written by the snakes head and tail and by apples coming and going,
+ * so keeping the grid up to date is O(1) per move. A byte holds up to
+ * 16 snakes and 15 apples, builds with more use two.
+ */
+#if MAX_SNAKES <= 16 && MAX_APPLES < 16
+typedef u8 Cell;
+#else
+typedef u16 Cell;
+#endif
+
+#define CELL_COUNT_BITS 4
+#define CELL_COUNT_MASK ((1 << CELL_COUNT_BITS) - 1)
+
+_Static_assert(MAX_SNAKES <= (1 << (8 * sizeof(Cell) - CELL_COUNT_BITS)), "Cell can't hold the snake index");
+_Static_assert(MAX_APPLES < (1 << (8 * sizeof(Cell) - CELL_COUNT_BITS)), "Cell can't hold the apple index");
+
+#define NO_FRAME ((u64) -1)
+
+#define FREE_CELL_WORDS ((MAX_CELLS + 63) / 64)
+
 typedef struct {
     u64 frame_index;
     u64 seed;
     bool apple_consumed_this_frame;
 	bool game_complete;
+	bool multiplayer; // Multiplayer matches end when one snake is left
 	int  winner_when_multiplayer;
+    u32 world_w; // Size of this match's world, up to MAX_WORLD_W x MAX_WORLD_H
+    u32 world_h;
     Snake snakes[MAX_SNAKES];
-    Apple apples[MAX_APPLES];
+    Apple apples[MAX_APPLES]; // The first num_apples are on the board
+
+    // Indexed by y * world_w + x, so smaller worlds only use the
+    // start of the array
+    Cell cells[MAX_CELLS];
+
+    // One bit per cell set when the cell has neither snakes nor
+    // apples on it. This is where new apples are spawned.
+    u64 free_cells[FREE_CELL_WORDS];
+
+    // Fenwick tree over the number of free cells of each word of
+    // free_cells, entry k-1 holding node k. It finds the word of the
+    // n-th free cell in O(log words).
+    u32 free_cell_counts[FREE_CELL_WORDS];
+
+    BodyChunk body_chunks[MAX_BODY_CHUNKS];
+
+    u32 num_free_cells;
+    u32 num_apples;
+    u32 free_body_chunk; // First chunk of the free list, NO_CHUNK if empty
+    u32 num_body_chunks; // Chunks past this one were never handed out
+
+    // Zobrist hash of the snake segments and apples on the board. It's
+    // updated whenever a cell changes, so peers can compare states
+    // without hashing the whole board.
+    u64 hash;
 } GameState;
 
-Gfx_Image *sprite_sheet;
+// Walks the body of a snake from the head to the tail
+typedef struct {
+    GameState *game;
+    Snake *snake;
+    u32 index;
+    u32 x;
+    u32 y;
+    Direction dir; // Body direction of the current part, 0 at the head
+    u32 chunk; // Where the next body direction is
+    u32 pos;
+} SnakeIter;
 
 int count_snakes(GameState *game)
 {
@@ -43,14 +144,182 @@ int count_snakes(GameState *game)
     return n;
 }
 
-void init_game_state(GameState *state)
+// Zobrist keys for each cell and snake, and for an apple on each cell.
+// They come from a fixed seed so every peer has the same ones. A segment's key mixes
+// the keys of its cell and snake, which keeps the tables proportional
+// to the world rather than to the world times the snakes.
+u64 zobrist_cell_keys[MAX_CELLS];
+u64 zobrist_snake_keys[MAX_SNAKES];
+u64 zobrist_apple_keys[MAX_CELLS];
+
+u64 splitmix64(u64 *state)
+{
+    u64 z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void init_zobrist_keys(void)
+{
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    u64 seed = 0x5eed;
+    for (int j = 0; j < MAX_CELLS; j++)
+        zobrist_cell_keys[j] = splitmix64(&seed);
+    for (int i = 0; i < MAX_SNAKES; i++)
+        zobrist_snake_keys[i] = splitmix64(&seed);
+    for (int j = 0; j < MAX_CELLS; j++)
+        zobrist_apple_keys[j] = splitmix64(&seed);
+}
+
+u64 zobrist_segment_key(u32 owner, u32 cell)
+{
+    u64 z = zobrist_cell_keys[cell] ^ zobrist_snake_keys[owner];
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Sets up an empty world of the given size, which must fit in
+// MAX_WORLD_W x MAX_WORLD_H
+void init_game_state_sized(GameState *state, bool multiplayer, u32 world_w, u32 world_h)
 {
+    assert(world_w > 0 && world_w <= MAX_WORLD_W && world_h > 0 && world_h <= MAX_WORLD_H);
+
     state->seed = 1;
     state->frame_index = 0;
 	state->game_complete = false;
+	state->multiplayer = multiplayer;
 	state->winner_when_multiplayer = -1;
+    state->world_w = world_w;
+    state->world_h = world_h;
     for (int i = 0; i < MAX_SNAKES; i++) state->snakes[i].used = false;
-    for (int i = 0; i < MAX_APPLES; i++) state->apples[i].used = false;
+    state->num_apples = 0;
+    memset(state->cells, 0, sizeof(state->cells));
+
+    u32 num_cells = world_w * world_h;
+    memset(state->free_cells, 0, sizeof(state->free_cells));
+    memset(state->free_cells, 0xff, num_cells / 64 * sizeof(u64));
+    if (num_cells % 64)
+        state->free_cells[num_cells / 64] = ((u64) 1 << (num_cells % 64)) - 1;
+    state->num_free_cells = num_cells;
+
+    // Each node adds up its own word and its children, which come
+    // before it
+    u32 num_words = (num_cells + 63) / 64;
+    memset(state->free_cell_counts, 0, sizeof(state->free_cell_counts));
+    for (u32 k = 1; k <= num_words; k++) {
+        state->free_cell_counts[k-1] += count_set_bits(state->free_cells[k-1]);
+        u32 parent = k + (k & -k);
+        if (parent <= num_words)
+            state->free_cell_counts[parent-1] += state->free_cell_counts[k-1];
+    }
+
+    state->free_body_chunk = NO_CHUNK;
+    state->num_body_chunks = 0;
+    state->hash = 0;
+    init_zobrist_keys();
+}
+
+void init_game_state(GameState *state, bool multiplayer)
+{
+    init_game_state_sized(state, multiplayer, WORLD_W, WORLD_H);
+}
+
+u32 cell_index(GameState *game, u32 x, u32 y)
+{
+    return y * game->world_w + x;
+}
+
+void set_cell_free(GameState *game, u32 x, u32 y, bool free)
+{
+    u32 i = cell_index(game, x, y);
+    u64 bit = (u64) 1 << (i % 64);
+
+    bool was_free = (game->free_cells[i / 64] & bit) != 0;
+    if (was_free == free) return;
+
+    UNDO(game->free_cells[i / 64]);
+    game->free_cells[i / 64] ^= bit;
+    if (free)
+        game->num_free_cells++;
+    else
+        game->num_free_cells--;
+
+    u32 num_words = (game->world_w * game->world_h + 63) / 64;
+    for (u32 k = i / 64 + 1; k <= num_words; k += k & -k) {
+        UNDO(game->free_cell_counts[k-1]);
+        game->free_cell_counts[k-1] += free ? 1 : -1;
+    }
+}
+
+bool cell_is_free(GameState *game, u32 x, u32 y)
+{
+    u32 i = cell_index(game, x, y);
+    return (game->free_cells[i / 64] >> (i % 64)) & 1;
+}
+
+// Returns the n-th free cell in row-major order
+void find_nth_free_cell(GameState *game, u32 n, u32 *x, u32 *y)
+{
+    assert(n < game->num_free_cells);
+
+    // Descend the Fenwick tree to the last word whose free cells
+    // before it are at most n, skipping those cells
+    u32 num_words = (game->world_w * game->world_h + 63) / 64;
+    u32 step = 1;
+    while (step * 2 <= num_words)
+        step *= 2;
+    u32 word = 0;
+    for (; step > 0; step /= 2) {
+        if (word + step <= num_words && game->free_cell_counts[word + step - 1] <= n) {
+            word += step;
+            n -= game->free_cell_counts[word - 1];
+        }
+    }
+
+    u32 i = word * 64 + index_of_nth_set_bit(game->free_cells[word], n);
+    *x = i % game->world_w;
+    *y = i / game->world_w;
+}
+
+u32 cell_count(GameState *game, u32 x, u32 y)
+{
+    return game->cells[cell_index(game, x, y)] & CELL_COUNT_MASK;
+}
+
+void occupy_cell(GameState *game, Snake *s, u32 x, u32 y)
+{
+    u32 i = cell_index(game, x, y);
+    u32 count = game->cells[i] & CELL_COUNT_MASK;
+    assert(count < CELL_COUNT_MASK);
+
+    u32 owner = s - game->snakes;
+    assert(count > 0 || game->cells[i] == 0, "Snakes must eat the apple before entering its cell");
+    UNDO(game->cells[i]);
+    game->cells[i] = (owner << CELL_COUNT_BITS) | (count + 1);
+    game->hash ^= zobrist_segment_key(owner, i);
+
+    if (count == 0)
+        set_cell_free(game, x, y, false);
+}
+
+void vacate_cell(GameState *game, Snake *s, u32 x, u32 y)
+{
+    u32 i = cell_index(game, x, y);
+    assert((game->cells[i] & CELL_COUNT_MASK) > 0);
+    UNDO(game->cells[i]);
+    game->cells[i]--;
+    game->hash ^= zobrist_segment_key(s - game->snakes, i);
+
+    // Apples are never placed under snakes, so the cell is free
+    // as soon as the last segment leaves it.
+    if ((game->cells[i] & CELL_COUNT_MASK) == 0) {
+        game->cells[i] = 0;
+        set_cell_free(game, x, y, true);
+    }
 }
 
 Snake *find_unused_snake_slot(GameState *game)
@@ -68,220 +337,360 @@ u64 get_random_from_game(GameState *game)
     return game->seed;
 }
 
-void init_snake(Snake *s, u32 x, u32 y)
+void init_snake(GameState *game, Snake *s, u32 x, u32 y)
 {
     assert(s && !s->used);
+    UNDO(*s);
     s->used = true;
     s->dir = DIR_LEFT;
     s->next_dir = DIR_LEFT;
     s->head_x = x;
     s->head_y = y;
-    s->body_idx = 0;
+    s->tail_x = x;
+    s->tail_y = y;
     s->body_len = 0;
-    s->iter_index = 0;
-    s->iter_x = 0;
-    s->iter_y = 0;
+    s->head_chunk = NO_CHUNK;
+    s->tail_chunk = NO_CHUNK;
+    occupy_cell(game, s, x, y);
 }
 
+bool consume_apple_at(GameState *game, u32 x, u32 y);
+
 void spawn_snake(GameState *game)
 {
     Snake *s = find_unused_snake_slot(game);
     assert(s && !s->used);
 
-    u32 x = get_random_from_game(game) % WORLD_W;
-    u32 y = get_random_from_game(game) % WORLD_H;
+    u32 x = get_random_from_game(game) % game->world_w;
+    u32 y = get_random_from_game(game) % game->world_h;
 
-    init_snake(s, x, y);
+    // A cell can't hold an apple and a snake, so a snake spawning on
+    // an apple eats it without growing
+    consume_apple_at(game, x, y);
+    init_snake(game, s, x, y);
 }
 
 void change_snake_direction(Snake *s, Direction d)
 {
     // Snakes can't face the opposite direction to their movement
-    if (d != -s->dir) s->next_dir = d;
+    if (d != -s->dir) {
+        UNDO(s->next_dir);
+        s->next_dir = d;
+    }
 }
 
-void start_iter_over_snake(Snake *s)
+// Wrap a coordinate that went one cell past an edge of a world of the
+// given size. Power of two sizes get a mask and the others two
+// selects, which compile to conditional moves. The size is the same
+// for the whole match, so the branch is always predicted.
+u32 wrap_coord(u32 v, u32 size)
 {
-    s->iter_index = 0;
+    if (IS_POW2(size))
+        return v & (size-1);
+    v = (v == (u32) -1) ? size-1 : v;
+    return (v == size) ? 0 : v;
 }
 
-bool next_snake_body_part(Snake *s, u32 *x, u32 *y)
+void step_in_direction(GameState *game, u32 *x, u32 *y, Direction dir)
 {
-    if (s->iter_index == 0) {
-        s->iter_x = s->head_x;
-        s->iter_y = s->head_y;
-    } else {
-        if (s->iter_index > s->body_len)
-            return false;
-        switch (s->body[(s->body_idx + s->iter_index) % COUNTOF(s->body)]) {
-            case DIR_UP   : s->iter_y--; break;
-            case DIR_DOWN : s->iter_y++; break;
-            case DIR_LEFT : s->iter_x++; break;
-            case DIR_RIGHT: s->iter_x--; break;
-        }
+    // Indexed by dir + 2
+    static const s8 step_x[] = {+1, 0, 0, 0, -1};
+    static const s8 step_y[] = {0, -1, 0, +1, 0};
 
-        // Clamp x to [0, WORLD_W-1]
-        if (s->iter_x == -1)
-            s->iter_x = WORLD_W-1;
-        else if (s->iter_x == WORLD_W)
-            s->iter_x = 0;
-
-        // Clamp y to [0, WORLD_H-1]
-        if (s->iter_y == -1)
-            s->iter_y = WORLD_H-1;
-        else if (s->iter_y == WORLD_H)
-            s->iter_y = 0;
-    }
-    s->iter_index++;
-    if (x) *x = s->iter_x;
-    if (y) *y = s->iter_y;
-    return true;
+    *x = wrap_coord(*x + step_x[dir + 2], game->world_w);
+    *y = wrap_coord(*y + step_y[dir + 2], game->world_h);
 }
 
-bool snake_head_collided_with_someone_else(Snake *p, GameState *game)
+u8 pack_dir(Direction d)
 {
-    for (int i = 0; i < MAX_SNAKES; i++) {
-        Snake *s = &game->snakes[i];
-        if (!s->used) continue;
+    // Vertical directions get the codes 0 and 1, horizontal ones 2 and 3
+    return (d < 0) | ((d == DIR_LEFT || d == DIR_RIGHT) << 1);
+}
 
-        start_iter_over_snake(s);
-        if (s == p) next_snake_body_part(s, NULL, NULL); // Don't compare the snake's head with itself
-        for (u32 x, y; next_snake_body_part(s, &x, &y); )
-            if (x == p->head_x && y == p->head_y)
-                return true;
+Direction unpack_dir(u8 code)
+{
+    static const Direction table[] = {DIR_UP, DIR_DOWN, DIR_LEFT, DIR_RIGHT};
+    return table[code & 3];
+}
+
+Direction get_chunk_dir(BodyChunk *chunk, u32 pos)
+{
+    return unpack_dir(chunk->dirs[pos / 4] >> (pos % 4 * 2));
+}
+
+void set_chunk_dir(BodyChunk *chunk, u32 pos, Direction d)
+{
+    u32 shift = pos % 4 * 2;
+    UNDO(chunk->dirs[pos / 4]);
+    chunk->dirs[pos / 4] = (chunk->dirs[pos / 4] & ~(3 << shift)) | (pack_dir(d) << shift);
+}
+
+u32 alloc_body_chunk(GameState *game)
+{
+    u32 c = game->free_body_chunk;
+    if (c != NO_CHUNK) {
+        game->free_body_chunk = game->body_chunks[c].next;
+        return c;
     }
-    return false;
+    assert(game->num_body_chunks < MAX_BODY_CHUNKS, "The body pool is exhausted");
+    return game->num_body_chunks++;
 }
 
-bool consume_apple_at(Apple *apples, u32 x, u32 y)
+void free_body_chunk(GameState *game, u32 c)
 {
-    int i = 0;
-    while (i < MAX_APPLES) {
-        if (apples[i].used && apples[i].x == x && apples[i].y == y) {
-            apples[i].used = false;
-            return true;
+    UNDO(game->body_chunks[c].next);
+    game->body_chunks[c].next = game->free_body_chunk;
+    game->free_body_chunk = c;
+}
+
+// Direction of the last body part, the one the tail follows
+Direction get_tail_dir(GameState *game, Snake *s)
+{
+    return get_chunk_dir(&game->body_chunks[s->tail_chunk], s->tail_pos);
+}
+
+// Stores the direction of the segment right behind the head,
+// which shifts all the other entries back by one.
+void push_body_dir(GameState *game, Snake *s, Direction d)
+{
+    if (s->head_chunk == NO_CHUNK || s->head_pos == 0) {
+        u32 c = alloc_body_chunk(game);
+        BodyChunk *chunk = &game->body_chunks[c];
+        UNDO(chunk->next);
+        UNDO(chunk->prev);
+        chunk->next = s->head_chunk;
+        chunk->prev = NO_CHUNK;
+
+        if (s->head_chunk == NO_CHUNK) {
+            s->tail_chunk = c;
+            s->tail_pos = BODY_CHUNK_DIRS - 1;
+        } else {
+            UNDO(game->body_chunks[s->head_chunk].prev);
+            game->body_chunks[s->head_chunk].prev = c;
         }
-        i++;
+        s->head_chunk = c;
+        s->head_pos = BODY_CHUNK_DIRS;
     }
-    return false;
+
+    s->head_pos--;
+    set_chunk_dir(&game->body_chunks[s->head_chunk], s->head_pos, d);
 }
 
-bool move_snake_forwards(Snake *s, Apple *apples)
+// Drops the direction of the last body part
+void pop_body_dir(GameState *game, Snake *s)
 {
-    s->dir = s->next_dir;
+    u32 c = s->tail_chunk;
+    if (c == s->head_chunk && s->tail_pos == s->head_pos) {
+        free_body_chunk(game, c);
+        s->head_chunk = NO_CHUNK;
+        s->tail_chunk = NO_CHUNK;
+    } else if (s->tail_pos == 0) {
+        s->tail_chunk = game->body_chunks[c].prev;
+        s->tail_pos = BODY_CHUNK_DIRS - 1;
+        free_body_chunk(game, c);
+    } else
+        s->tail_pos--;
+}
 
-    switch (s->dir) {
-        case DIR_UP   : s->head_y++; break;
-        case DIR_DOWN : s->head_y--; break;
-        case DIR_LEFT : s->head_x--; break;
-        case DIR_RIGHT: s->head_x++; break;
+// Returns the chunks of a body to the pool
+void free_body(GameState *game, Snake *s)
+{
+    if (s->head_chunk == NO_CHUNK)
+        return;
+
+    // The tail chunk's next link is stale once the chunk after it
+    // was dropped, so stop there
+    for (u32 c = s->head_chunk;;) {
+        u32 next = game->body_chunks[c].next;
+        free_body_chunk(game, c);
+        if (c == s->tail_chunk) break;
+        c = next;
     }
+    s->head_chunk = NO_CHUNK;
+    s->tail_chunk = NO_CHUNK;
+}
 
-    // Clamp x to [0, WORLD_W-1]
-    if (s->head_x == -1)
-        s->head_x = WORLD_W-1;
-    else if (s->head_x == WORLD_W)
-        s->head_x = 0;
-
-    // Clamp y to [0, WORLD_H-1]
-    if (s->head_y == -1)
-        s->head_y = WORLD_H-1;
-    else if (s->head_y == WORLD_H)
-        s->head_y = 0;
-
-    s->body[s->body_idx] = s->dir;
-    if (s->body_idx > 0)
-        s->body_idx--;
-    else
-        s->body_idx = COUNTOF(s->body)-1;
+SnakeIter start_iter_over_snake(GameState *game, Snake *s)
+{
+    return (SnakeIter) {.game=game, .snake=s, .index=0, .x=s->head_x, .y=s->head_y,
+                        .dir=0, .chunk=s->head_chunk, .pos=s->head_pos};
+}
 
-    if (consume_apple_at(apples, s->head_x, s->head_y)) {
-        s->body_len++;
-        return true;
-    } else {
+// Body direction of the part after the current one, which must not
+// be the tail
+Direction peek_snake_body_dir(SnakeIter *iter)
+{
+    return get_chunk_dir(&iter->game->body_chunks[iter->chunk], iter->pos);
+}
+
+bool next_snake_body_part(SnakeIter *iter, u32 *x, u32 *y)
+{
+    Snake *s = iter->snake;
+    if (iter->index > s->body_len)
         return false;
+
+    // Each body entry holds the direction the snake moved in to get
+    // from that segment to the previous one, so walk it backwards.
+    if (iter->index > 0) {
+        BodyChunk *chunk = &iter->game->body_chunks[iter->chunk];
+        iter->dir = get_chunk_dir(chunk, iter->pos);
+        if (++iter->pos == BODY_CHUNK_DIRS) {
+            iter->chunk = chunk->next;
+            iter->pos = 0;
+        }
+        step_in_direction(iter->game, &iter->x, &iter->y, -iter->dir);
     }
+
+    iter->index++;
+    if (x) *x = iter->x;
+    if (y) *y = iter->y;
+    return true;
 }
 
-int count_apples(Apple *apples)
+void kill_snake(GameState *game, Snake *s)
 {
-    int n = 0;
-    for (int i = 0; i < MAX_APPLES; i++)
-        if (apples[i].used)
-            n++;
-    return n;
+    SnakeIter iter = start_iter_over_snake(game, s);
+    for (u32 x, y; next_snake_body_part(&iter, &x, &y); )
+        vacate_cell(game, s, x, y);
+    UNDO(*s);
+    free_body(game, s);
+    s->used = false;
 }
 
-bool location_occupied_by_snake_or_apple(GameState *game, u32 x, u32 y)
+bool snake_head_collided_with_someone_else(Snake *p, GameState *game)
 {
-    for (int i = 0; i < MAX_SNAKES; i++) {
-        Snake *s = &game->snakes[i];
-        if (!s->used) continue;
+    // The head itself is one of the segments on its cell
+    return cell_count(game, p->head_x, p->head_y) > 1;
+}
 
-        start_iter_over_snake(s);
-        u32 snake_body_part_x;
-        u32 snake_body_part_y;
-        while (next_snake_body_part(s, &snake_body_part_x, &snake_body_part_y))
-            if (snake_body_part_x == x && snake_body_part_y == y)
-                return true;
-    }
+void set_apple_cell(GameState *game, u32 a, u32 x, u32 y)
+{
+    u32 i = cell_index(game, x, y);
+    UNDO(game->cells[i]);
+    game->cells[i] = (a + 1) << CELL_COUNT_BITS;
+}
 
-    for (int i = 0; i < MAX_APPLES; i++) {
-        Apple *a = &game->apples[i];
-        if (a->used && a->x == x && a->y == y)
-            return true;
+void place_apple(GameState *game, u32 x, u32 y)
+{
+    assert(game->num_apples < MAX_APPLES && cell_is_free(game, x, y));
+    u32 a = game->num_apples++;
+    UNDO(game->apples[a]);
+    game->apples[a] = (Apple) {.x=x, .y=y};
+    set_apple_cell(game, a, x, y);
+    set_cell_free(game, x, y, false);
+    game->hash ^= zobrist_apple_keys[cell_index(game, x, y)];
+}
+
+bool consume_apple_at(GameState *game, u32 x, u32 y)
+{
+    // A cell with snakes on it can't have an apple
+    u32 i = cell_index(game, x, y);
+    Cell cell = game->cells[i];
+    if (cell == 0 || (cell & CELL_COUNT_MASK) != 0)
+        return false;
+
+    // The last apple fills the gap so the others stay packed
+    u32 a = (cell >> CELL_COUNT_BITS) - 1;
+    u32 last = --game->num_apples;
+    if (a != last) {
+        Apple moved = game->apples[last];
+        UNDO(game->apples[a]);
+        game->apples[a] = moved;
+        set_apple_cell(game, a, moved.x, moved.y);
     }
 
-    return false;
+    UNDO(game->cells[i]);
+    game->cells[i] = 0;
+    set_cell_free(game, x, y, true);
+    game->hash ^= zobrist_apple_keys[i];
+    return true;
 }
 
-bool choose_apple_location(GameState *game, u32 *out_x, u32 *out_y)
+// Completes a move once s->dir and the head position were updated:
+// updates the body and the tail, eats the apple and updates the cells.
+SnakeStep finish_snake_move(GameState *game, Snake *s)
 {
-    for (int i = 0; i < 1000; i++) {
-        u32 x = get_random_from_game(game) % WORLD_W;
-        u32 y = get_random_from_game(game) % WORLD_H;
-        if (!location_occupied_by_snake_or_apple(game, x, y)) {
-            if (out_x) *out_x = x;
-            if (out_y) *out_y = y;
-            return true;
-        }
+    SnakeStep step = {0};
+
+    step.entered_x = s->head_x;
+    step.entered_y = s->head_y;
+
+    push_body_dir(game, s, s->dir);
+
+    step.grew = consume_apple_at(game, s->head_x, s->head_y);
+    step.left_cell = !step.grew;
+    if (step.grew) {
+        s->body_len++;
+    } else {
+        step.left_x = s->tail_x;
+        step.left_y = s->tail_y;
+        if (s->body_len == 0) {
+            s->tail_x = s->head_x;
+            s->tail_y = s->head_y;
+        } else
+            step_in_direction(game, &s->tail_x, &s->tail_y, get_tail_dir(game, s));
+        pop_body_dir(game, s);
     }
-    for (u32 x = 0; x < WORLD_W; x++)
-        for (u32 y = 0; y < WORLD_H; y++) {
-            if (!location_occupied_by_snake_or_apple(game, x, y)) {
-                if (out_x) *out_x = x;
-                if (out_y) *out_y = y;
-                return true;
-            }
-        }
-    return false;
+
+    // The tail leaves its cell before the head enters the new one,
+    // so a snake can chase its own tail.
+    if (step.left_cell)
+        vacate_cell(game, s, step.left_x, step.left_y);
+    occupy_cell(game, s, step.entered_x, step.entered_y);
+
+    return step;
 }
 
-void make_sure_there_is_at_least_this_amount_of_apples(GameState *game, int min_apples)
+SnakeStep move_snake_forwards(GameState *game, Snake *s)
 {
-    int num_apples = count_apples(game->apples);
-    if (num_apples >= min_apples) return;
+    UNDO(*s);
+    s->dir = s->next_dir;
+    step_in_direction(game, &s->head_x, &s->head_y, s->dir);
+    return finish_snake_move(game, s);
+}
 
-    int missing = min_apples - num_apples;
-    for (int i = 0; i < MAX_APPLES && missing > 0; i++) {
+int count_apples(GameState *game)
+{
+    return game->num_apples;
+}
 
-        Apple *a = &game->apples[i];
+bool location_occupied_by_snake_or_apple(GameState *game, u32 x, u32 y)
+{
+    return !cell_is_free(game, x, y);
+}
 
-        if (!a->used) {
-            if (choose_apple_location(game, &a->x, &a->y)) {
-                a->used = true;
-                missing--;
-            }
-        }
+bool choose_apple_location(GameState *game, u32 *out_x, u32 *out_y)
+{
+    if (game->num_free_cells == 0)
+        return false;
+
+    // The free cell set only depends on the game state, so all peers
+    // pick the same cell for the same random value.
+    u32 n = get_random_from_game(game) % game->num_free_cells;
+    find_nth_free_cell(game, n, out_x, out_y);
+    return true;
+}
+
+void make_sure_there_is_at_least_this_amount_of_apples(GameState *game, int min_apples)
+{
+    min_apples = MIN(min_apples, MAX_APPLES);
+    while (count_apples(game) < min_apples) {
+        u32 x, y;
+        if (!choose_apple_location(game, &x, &y))
+            break;
+        place_apple(game, x, y);
     }
 }
 
 void apply_input_to_game_instance(GameState *game, Input input)
 {
-    assert(game->snakes[input.player].used == true);
+    // When re-simulating after a late input a snake may die earlier
+    // than it did the first time, so its later inputs are dropped.
+    if (!game->snakes[input.player].used)
+        return;
 
     if (input.disconnect) {
-        game->snakes[input.player].used = false;
+        kill_snake(game, &game->snakes[input.player]);
     } else {
         switch (input.dir) {
             case DIR_UP   : change_snake_direction(&game->snakes[input.player], DIR_UP);    break;
@@ -292,10 +701,30 @@ void apply_input_to_game_instance(GameState *game, Input input)
     }
 }
 
+// Called after a snake moved. Returns true if it didn't hit anything,
+// otherwise the snake dies or, if it was the last one that could, the
+// match ends.
+bool resolve_snake_collision(GameState *game, Snake *s)
+{
+    if (!snake_head_collided_with_someone_else(s, game))
+        return true;
+
+    int final_snake_count = game->multiplayer ? 1 : 0;
+    if (count_snakes(game) == final_snake_count+1)
+        game->game_complete = true;
+    else
+        kill_snake(game, s); // RIP
+    return false;
+}
+
 void update_game_instance(GameState *game)
 {
-	if (game->game_complete)
+	// The clock keeps running after the match is over so that the
+	// rollback history stays indexed by frame.
+	if (game->game_complete) {
+		game->frame_index++;
 		return;
+	}
 
     game->apple_consumed_this_frame = false;
 
@@ -305,19 +734,11 @@ void update_game_instance(GameState *game)
         Snake *s = &game->snakes[i];
         if (!s->used) continue;
 
-        bool grow = move_snake_forwards(s, game->apples);
-        if (grow) game->apple_consumed_this_frame = true;
-
-        if (snake_head_collided_with_someone_else(s, game)) {
-			int alive_snakes = count_snakes(game);
-			int final_snake_count = multiplayer ? 1 : 0;
-			if (count_snakes(game) == final_snake_count+1)
-				game->game_complete = true;
-			else
-	            s->used = false; // RIP
-		} else {
+        SnakeStep step = move_snake_forwards(game, s);
+        if (step.grew) game->apple_consumed_this_frame = true;
+
+        if (resolve_snake_collision(game, s))
 			first_alive_snake = i;
-		}
     }
 
 	if (game->game_complete)
@@ -327,11 +748,15 @@ void update_game_instance(GameState *game)
     game->frame_index++;
 }
 
-void draw_snake(Snake *s, float offset_x, float offset_y, float scale)
+#ifndef OOGABOOGA_HEADLESS
+
+Gfx_Image *sprite_sheet;
+
+void draw_snake(GameState *game, Snake *s, float offset_x, float offset_y, float scale)
 {
     //Direction prev_dir;
-    start_iter_over_snake(s);
-    for (u32 i = 0, x, y; next_snake_body_part(s, &x, &y); i++) {
+    SnakeIter iter = start_iter_over_snake(game, s);
+    for (u32 i = 0, x, y; next_snake_body_part(&iter, &x, &y); i++) {
 
         if (i == 0) {
 
@@ -365,7 +790,7 @@ void draw_snake(Snake *s, float offset_x, float offset_y, float scale)
             int sprite_x = 0;
             int sprite_y = 1;
             int rotate = 0;
-            switch (s->body[(s->body_idx + i) % MAX_SNAKE_SIZE]) {
+            switch (iter.dir) {
                 case DIR_UP   : rotate = 1; break;
                 case DIR_DOWN : rotate = 3; break;
                 case DIR_LEFT : rotate = 0; break;
@@ -391,8 +816,8 @@ void draw_snake(Snake *s, float offset_x, float offset_y, float scale)
             int sprite_y = 1;
             int rotate = 0;
 
-            Direction curr_dir = s->body[(s->body_idx + i + 0) % MAX_SNAKE_SIZE];
-            Direction next_dir = s->body[(s->body_idx + i + 1) % MAX_SNAKE_SIZE];
+            Direction curr_dir = iter.dir;
+            Direction next_dir = peek_snake_body_dir(&iter);
 
             #define PAIR(X, Y) (((u64) (u32) (X) << 32) | (u64) (u32) (Y))
             switch (PAIR(curr_dir, next_dir)) {
@@ -433,13 +858,13 @@ void draw_game_instance(GameState *game)
 
     float scale;
     {
-        float scale_x = nopad_window_w / (WORLD_W * TILE_W);
-        float scale_y = nopad_window_h / (WORLD_H * TILE_H);
+        float scale_x = nopad_window_w / (game->world_w * TILE_W);
+        float scale_y = nopad_window_h / (game->world_h * TILE_H);
         scale = MIN(scale_x, scale_y);
     }
 
-    float px_world_w = scale * WORLD_W * TILE_W;
-    float px_world_h = scale * WORLD_H * TILE_H;
+    float px_world_w = scale * game->world_w * TILE_W;
+    float px_world_h = scale * game->world_h * TILE_H;
 
     // Offsets needed to center stuff
     float offset_x = (window.width  - px_world_w) / 2;
@@ -452,12 +877,13 @@ void draw_game_instance(GameState *game)
         Snake *s = &game->snakes[i];
         if (!s->used) continue;
 
-        draw_snake(s, offset_x, offset_y, scale);
+        draw_snake(game, s, offset_x, offset_y, scale);
     }
 
-    for (int i = 0; i < MAX_APPLES; i++) {
+    for (int i = 0; i < count_apples(game); i++) {
         Apple *a = &game->apples[i];
-        if (a->used)
-            draw_rect(v2(offset_x + a->x * scale * TILE_W, offset_y + a->y * scale * TILE_H), v2(scale * TILE_W, scale * TILE_H), COLOR_RED);
+        draw_rect(v2(offset_x + a->x * scale * TILE_W, offset_y + a->y * scale * TILE_H), v2(scale * TILE_W, scale * TILE_H), COLOR_RED);
     }
 }
+
+#endif /* OOGABOOGA_HEADLESS */
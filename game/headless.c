@@ -0,0 +1,245 @@
+/*
+ * Stand-ins for the parts of oogabooga the simulation uses, so that
+ * game.c and rollback.c can be built on Linux without a window, audio
+ * or Steam. This replaces oogabooga/oogabooga.c in build_headless.c.
+ */
+
+#define OOGABOOGA_HEADLESS 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t  s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef float f32;
+typedef double f64;
+typedef f32 float32;
+typedef f64 float64;
+
+typedef u8 bool;
+#define false 0
+#define true 1
+
+#define assert(cond, ...) {if (!(cond)) { printf("Assertion failed in file " __FILE__ " on line %d\nFailed Condition: " #cond "\n", __LINE__); fflush(stdout); abort(); }}
+
+// Winsock has these, glibc doesn't
+u64 htonll(u64 value)
+{
+    return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? value : __builtin_bswap64(value);
+}
+
+u64 ntohll(u64 value)
+{
+    return htonll(value);
+}
+
+u64 next_random(u64 value)
+{
+    return value * 6364136223846793005ull + 1442695040888963407ull;
+}
+
+float64 os_get_current_time_in_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Threads and atomics, with the same interface as oogabooga's
+ */
+typedef struct Thread Thread;
+
+typedef void(*Thread_Proc)(Thread*);
+
+typedef struct Thread {
+    void *data;
+    Thread_Proc proc;
+    pthread_t os_handle;
+} Thread;
+
+void *headless_thread_invoker(void *param)
+{
+    Thread *t = param;
+    t->proc(t);
+    return NULL;
+}
+
+void os_thread_init(Thread *t, Thread_Proc proc)
+{
+    memset(t, 0, sizeof(Thread));
+    t->proc = proc;
+}
+
+void os_thread_start(Thread *t)
+{
+    int result = pthread_create(&t->os_handle, NULL, headless_thread_invoker, t);
+    assert(result == 0, "Failed creating thread");
+}
+
+void os_thread_join(Thread *t)
+{
+    pthread_join(t->os_handle, NULL);
+}
+
+void os_yield_thread(void)
+{
+    sched_yield();
+}
+
+bool compare_and_swap_32(uint32_t *a, uint32_t b, uint32_t old)
+{
+    return __sync_bool_compare_and_swap(a, old, b);
+}
+
+bool compare_and_swap_64(uint64_t *a, uint64_t b, uint64_t old)
+{
+    return __sync_bool_compare_and_swap(a, old, b);
+}
+
+// The game code follows oogabooga's printf, where %cs formats a C
+// string. Translate it to %s before handing the format to libc.
+int headless_printf(const char *fmt, ...)
+{
+    char buffer[1024];
+    int n = 0;
+    for (int i = 0; fmt[i] && n < (int) sizeof(buffer) - 1; i++) {
+        if (fmt[i] == '%' && fmt[i+1] == 'c' && fmt[i+2] == 's') {
+            buffer[n++] = '%';
+            buffer[n++] = 's';
+            i += 2;
+        } else
+            buffer[n++] = fmt[i];
+    }
+    buffer[n] = '\0';
+
+    va_list args;
+    va_start(args, fmt);
+    int result = vprintf(buffer, args);
+    va_end(args);
+    return result;
+}
+
+#define printf headless_printf
+
+/*
+ * Allocation counter. build_headless.sh links with --wrap for malloc,
+ * calloc and realloc so every heap allocation made by the process goes
+ * through these.
+ */
+#define HAVE_ALLOCATION_COUNTER 1
+
+u64 num_allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    num_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    num_allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    num_allocations++;
+    return __real_realloc(ptr, size);
+}
+
+u64 get_allocation_count(void)
+{
+    return num_allocations;
+}
+
+/*
+ * oogabooga's heap allocator, backed by malloc
+ */
+typedef struct Allocator {
+    void *data;
+} Allocator;
+
+Allocator get_heap_allocator(void)
+{
+    return (Allocator) {0};
+}
+
+void *alloc(Allocator allocator, u64 size)
+{
+    return malloc(size);
+}
+
+void dealloc(Allocator allocator, void *p)
+{
+    free(p);
+}
+
+/*
+ * Whole-file reads and writes, with oogabooga's interface
+ */
+typedef struct string {
+    u64 count;
+    u8 *data;
+} string;
+
+#define STR(s) ((string) {strlen((const char*)(s)), (u8*)(s)})
+
+FILE *headless_open_file(string path, const char *mode)
+{
+    char buffer[4096];
+    if (path.count >= sizeof(buffer))
+        return NULL;
+    memcpy(buffer, path.data, path.count);
+    buffer[path.count] = '\0';
+    return fopen(buffer, mode);
+}
+
+bool os_read_entire_file_s(string path, string *result, Allocator allocator)
+{
+    FILE *f = headless_open_file(path, "rb");
+    if (!f) return false;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    result->data = alloc(allocator, size > 0 ? size : 1);
+    result->count = fread(result->data, 1, size, f);
+    fclose(f);
+    return size >= 0 && result->count == (u64) size;
+}
+
+bool os_write_entire_file_s(string path, string data)
+{
+    FILE *f = headless_open_file(path, "wb");
+    if (!f) return false;
+
+    bool ok = fwrite(data.data, 1, data.count, f) == data.count;
+    return fclose(f) == 0 && ok;
+}
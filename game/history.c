@@ -0,0 +1,238 @@
+/*
+ * Compressed history of every frame of a match, for replays, late
+ * joiners and rollback windows longer than the snapshot ring.
+ *
+ * Consecutive states differ in a few dozen bytes, so each frame is
+ * stored as its XOR with the previous frame, where the runs of zeros
+ * are replaced by their length. A delta is a list of runs:
+ *
+ *   varint skip, varint length, length bytes
+ *
+ * meaning "leave skip bytes alone, then XOR the next length bytes
+ * with these". Every keyframe_interval frames the state is stored
+ * as a delta against an all-zero state instead, which also packs well
+ * as most of a GameState is empty board and unused body ring. So any
+ * frame can be rebuilt from at most keyframe_interval deltas.
+ */
+
+#define DEFAULT_KEYFRAME_INTERVAL 64
+
+// Unchanged runs shorter than this are stored inside the surrounding
+// change, as starting a new run costs two bytes of varints
+#define HISTORY_MIN_SKIP 3
+
+// A run costs at most skip + 2 * length bytes (one more for the first
+// one, which may skip nothing), so a delta is about twice the state
+// at worst
+#define MAX_STATE_DELTA_SIZE (2 * sizeof(GameState) + 16)
+
+typedef struct {
+    u64 first_frame;
+    u32 num_frames;
+    u32 keyframe_interval;
+
+    ByteQueue data;    // Deltas back to back
+    ByteQueue offsets; // u32 offset into data of the delta of every frame
+
+    GameState last;    // The last frame pushed, the base of the next delta
+
+    // The last frame read back, so playing frames in order costs one
+    // delta each
+    GameState cursor;
+    u64 cursor_index;  // NO_FRAME when there's none
+} SnapshotHistory;
+
+// Bit i of the result is set when byte i of the word isn't zero
+u8 nonzero_bytes(u64 word)
+{
+    u64 low7 = 0x7F7F7F7F7F7F7F7Full;
+    u64 high = (((word & low7) + low7) | word) & ~low7;
+    return ((high >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+// Position of the first set bit at or after i, or size if none is
+u32 next_changed_byte(u64 *changed, u32 i, u32 size)
+{
+    if (i >= size)
+        return size;
+
+    u32 k = i / 64;
+    u64 bits = changed[k] & (~0ull << (i % 64));
+    while (!bits) {
+        if (++k * 64 >= size)
+            return size;
+        bits = changed[k];
+    }
+    return k * 64 + __builtin_ctzll(bits);
+}
+
+// Encodes the bytes where state differs from base and returns the size
+// of the delta. Size must be a multiple of 8.
+u32 encode_state_delta(u8 *dst, void *base, void *state, u32 size)
+{
+    u8 *a = base, *b = state;
+    u8 *start = dst;
+
+    // One bit per changed byte, built a word at a time so that only the
+    // runs cost branches
+    u64 changed[(sizeof(GameState) + 63) / 64] = {0};
+    assert(size <= sizeof(GameState) && size % 8 == 0);
+    u32 num_words = size / 8;
+    for (u32 k = 0; k * 8 < num_words; k++) {
+        u64 bits = 0;
+        for (u32 w = k * 8; w < MIN(num_words, k * 8 + 8); w++) {
+            u64 x, y;
+            memcpy(&x, a + 8 * w, sizeof(u64));
+            memcpy(&y, b + 8 * w, sizeof(u64));
+            bits |= (u64) nonzero_bytes(x ^ y) << (w % 8 * 8);
+        }
+        changed[k] = bits;
+    }
+
+    u32 last_end = 0;
+    u32 i = next_changed_byte(changed, 0, size);
+    while (i < size) {
+
+        // The run ends at the first HISTORY_MIN_SKIP unchanged bytes
+        u32 end = i + 1;
+        u32 next = next_changed_byte(changed, end, size);
+        while (next < size && next - end < HISTORY_MIN_SKIP) {
+            end = next + 1;
+            next = next_changed_byte(changed, end, size);
+        }
+
+        dst += write_varint(dst, i - last_end);
+        dst += write_varint(dst, end - i);
+        for (u32 j = i; j < end; j++)
+            *dst++ = a[j] ^ b[j];
+
+        last_end = end;
+        i = next;
+    }
+    return dst - start;
+}
+
+// Returns false if the delta is malformed, which leaves the state
+// partly updated. Replays read them from files.
+bool apply_state_delta(void *state, u32 size, u8 *delta, u32 delta_size)
+{
+    u8 *s = state;
+    u8 *end = delta + delta_size;
+    u64 pos = 0;
+
+    while (delta < end) {
+        u64 skip, len;
+        if (!read_varint_checked(&delta, end, &skip) || !read_varint_checked(&delta, end, &len))
+            return false;
+        if (skip > size - pos || len > size - pos - skip || len > (u64) (end - delta))
+            return false;
+        pos += skip;
+        for (u64 j = 0; j < len; j++)
+            s[pos + j] ^= delta[j];
+        pos += len;
+        delta += len;
+    }
+    return true;
+}
+
+bool history_is_keyframe(SnapshotHistory *history, u32 index)
+{
+    return index % history->keyframe_interval == 0;
+}
+
+// Appends the next frame. Frames must be pushed in order with no gaps.
+void history_push(SnapshotHistory *history, GameState *game)
+{
+    static GameState empty_state;
+
+    assert(game->frame_index == history->first_frame + history->num_frames, "History frames must be consecutive");
+
+    bool ok = byte_queue_ensure_min_free_space(&history->data, MAX_STATE_DELTA_SIZE)
+           && byte_queue_ensure_min_free_space(&history->offsets, sizeof(u32));
+    assert(ok, "Out of memory for the state history");
+
+    u32 offset = byte_queue_used_space(&history->data);
+    memcpy(byte_queue_start_write(&history->offsets), &offset, sizeof(u32));
+    byte_queue_end_write(&history->offsets, sizeof(u32));
+
+    GameState *base = history_is_keyframe(history, history->num_frames) ? &empty_state : &history->last;
+    u32 size = encode_state_delta((u8*) byte_queue_start_write(&history->data), base, game, sizeof(GameState));
+    byte_queue_end_write(&history->data, size);
+
+    memcpy(&history->last, game, sizeof(GameState));
+    history->num_frames++;
+}
+
+// Starts a history at the given state. A keyframe_interval of 0 picks
+// the default.
+void history_init(SnapshotHistory *history, GameState *first, u32 keyframe_interval)
+{
+    history->first_frame = first->frame_index;
+    history->num_frames = 0;
+    history->keyframe_interval = keyframe_interval ? keyframe_interval : DEFAULT_KEYFRAME_INTERVAL;
+    history->cursor_index = NO_FRAME;
+    byte_queue_init(&history->data);
+    byte_queue_init(&history->offsets);
+    history_push(history, first);
+}
+
+void history_free(SnapshotHistory *history)
+{
+    byte_queue_free(&history->data);
+    byte_queue_free(&history->offsets);
+}
+
+bool history_has_frame(SnapshotHistory *history, u64 frame_index)
+{
+    return frame_index >= history->first_frame
+        && frame_index - history->first_frame < history->num_frames;
+}
+
+// Bytes used by the history, not counting the last frame kept in the
+// clear to encode the next one
+u64 history_size(SnapshotHistory *history)
+{
+    return byte_queue_used_space(&history->data) + byte_queue_used_space(&history->offsets);
+}
+
+void apply_history_delta(SnapshotHistory *history, u32 index, GameState *game)
+{
+    u32 *offsets = (u32*) byte_queue_start_read(&history->offsets);
+    u32 begin = offsets[index];
+    u32 end = (index + 1 < history->num_frames) ? offsets[index + 1] : byte_queue_used_space(&history->data);
+    u8 *data = (u8*) byte_queue_start_read(&history->data);
+    bool ok = apply_state_delta(game, sizeof(GameState), data + begin, end - begin);
+    assert(ok, "Corrupted state delta");
+}
+
+// Rebuilds a frame from the keyframe before it, or from the last frame
+// read if that's closer. Returns false if the frame isn't in the
+// history.
+bool history_get(SnapshotHistory *history, u64 frame_index, GameState *game)
+{
+    if (!history_has_frame(history, frame_index))
+        return false;
+
+    u32 index = frame_index - history->first_frame;
+    if (index + 1 == history->num_frames) {
+        memcpy(game, &history->last, sizeof(GameState));
+        return true;
+    }
+
+    GameState *cursor = &history->cursor;
+    u32 keyframe = index - index % history->keyframe_interval;
+    u32 first_delta;
+    if (history->cursor_index != NO_FRAME && history->cursor_index >= keyframe && history->cursor_index <= index)
+        first_delta = history->cursor_index + 1;
+    else {
+        memset(cursor, 0, sizeof(GameState));
+        first_delta = keyframe;
+    }
+    for (u32 i = first_delta; i <= index; i++)
+        apply_history_delta(history, i, cursor);
+    history->cursor_index = index;
+
+    assert(cursor->frame_index == frame_index);
+    memcpy(game, cursor, sizeof(GameState));
+    return true;
+}
@@ -2,6 +2,10 @@
 typedef enum {
 	MESSAGE_INPUT,
 	MESSAGE_SYNC,
+	MESSAGE_STATE_HASH,
+	MESSAGE_PING,
+	MESSAGE_PONG,
+	MESSAGE_INPUTS,
 } MessageType;
 
 typedef struct {
@@ -17,116 +21,494 @@ typedef struct {
 	u64 time;
 } SyncMessage;
 
-typedef struct { // TODO: Make sure there is no padding
+bool is_server;
+bool multiplayer;
+
+// Frames between pressing a key and the input taking effect. Every
+// peer delays its own inputs before sending them, so each can tune
+// its delay to its connection without the others knowing.
+u32 input_delay_frames = INPUT_FRAME_DELAY_COUNT;
+
+// Round trip time of a connection, smoothed like TCP does (RFC 6298)
+typedef struct {
+	bool    measured;
+	float64 srtt_us;
+	float64 jitter_us; // Mean deviation of the samples from srtt_us
+} RttEstimate;
+
+void add_rtt_sample(RttEstimate *rtt, float64 sample_us)
+{
+	if (!rtt->measured) {
+		rtt->srtt_us = sample_us;
+		rtt->jitter_us = sample_us / 2;
+		rtt->measured = true;
+	} else {
+		rtt->jitter_us = 0.75 * rtt->jitter_us + 0.25 * fabs(rtt->srtt_us - sample_us);
+		rtt->srtt_us = 0.875 * rtt->srtt_us + 0.125 * sample_us;
+	}
+}
+
+u32 get_current_player_id(void);
+u64 get_current_frame_index(void);
+void receive_state_hash(u32 player, u64 frame_index, u64 hash);
+bool can_apply_input(Input input);
+
+#if HAVE_MULTIPLAYER
+
+/*
+ * Wire protocol. Everything is a varint unless noted. The server
+ * opens with the initial state:
+ *
+ *   version time_us seed num_snakes self_index world_w world_h
+ *   location_size, location (location_size bytes)
+ *   head_x head_y for each snake
+ *
+ * and peers then exchange messages that start with their type (a
+ * byte):
+ *
+ *   MESSAGE_INPUT       frame_delta player_dir
+ *   MESSAGE_SYNC        frame_delta time_us
+ *   MESSAGE_STATE_HASH  frame_delta, hash (8 bytes, network order)
+ *   MESSAGE_PING        time_us
+ *   MESSAGE_PONG        time_us of the ping
+ *
+ * frame_delta is the frame of the message minus the frame of the last
+ * message with one the peer got on the connection, zigzag encoded as
+ * the inputs of different players don't come in frame order.
+ * Connections are reliable and ordered, so both ends know that frame
+ * without acknowledging it. player_dir is the byte (player << 2 |
+ * direction), with the direction as in direction_to_bits. Players from
+ * PROTOCOL_ESCAPE_PLAYER up are sent as that and followed by a varint
+ * with the player. Clients send their inputs as player 0, the server
+ * knows who they are.
+ *
+ * Unless redundant_inputs is off, inputs go in unreliable packets
+ * instead, one per transport message, so a lost one doesn't hold up
+ * the inputs after it:
+ *
+ *   MESSAGE_INPUTS      ack first_seq count, count times frame_delta player_dir
+ *
+ * Inputs are numbered per connection. A packet carries the oldest
+ * count inputs the peer didn't acknowledge yet, from first_seq on, and
+ * ack is the number of the next input expected from the peer, so every
+ * input is sent again each frame until it's acknowledged. Packets can
+ * be lost or reordered, so their frame deltas count from 0 at the
+ * start of each packet.
+ *
+ * Version 0 had no version: fixed size fields in network order, 17
+ * bytes for an input and a 1024 byte location. Version 1 had no input
+ * packets.
+ */
+
+#define NET_PROTOCOL_VERSION 2
+#define PROTOCOL_ESCAPE_PLAYER 63
+#define PROTOCOL_MAX_MESSAGE_SIZE 32 // But the initial state and input packets
+#define INPUT_PACKET_MAX_SIZE (1 + 3 * 5 + INPUT_REDUNDANCY * (10 + 1 + 5))
+
+_Static_assert(INPUT_PACKET_MAX_SIZE <= NET_MAX_UNRELIABLE_SIZE, "Input packets don't fit an unreliable message");
+_Static_assert(NET_PROTOCOL_VERSION != MESSAGE_INPUTS, "The initial state would look like an input packet");
+
+// Send inputs in unreliable packets that repeat the unacknowledged ones
+bool redundant_inputs = true;
+
+// A message after the initial state. The fields its type doesn't have
+// are zero.
+typedef struct {
+	u8  type;
+	u64 frame_index; // Input, sync and state hash
+	u64 time_us;     // Sync, ping and pong
+	u64 hash;
+	u32 player;      // Input
+	Direction dir;   // Input
+} ProtocolMessage;
+
+bool message_has_frame(u8 type)
+{
+	return type == MESSAGE_INPUT || type == MESSAGE_SYNC || type == MESSAGE_STATE_HASH;
+}
+
+// The player_dir byte, and the player after it when it doesn't fit
+int write_player_dir(u8 *dst, u32 player, Direction dir)
+{
+	dst[0] = MIN(player, PROTOCOL_ESCAPE_PLAYER) << 2 | direction_to_bits(dir);
+	if (player < PROTOCOL_ESCAPE_PLAYER)
+		return 1;
+	return 1 + write_varint(dst + 1, player);
+}
+
+// Returns false if the player doesn't fit in a match, so the message
+// is malformed
+bool read_player_dir(u8 **p, u8 *end, u32 *player, Direction *dir)
+{
+	if (*p == end) return false;
+	*player = **p >> 2;
+	*dir = bits_to_direction(**p);
+	(*p)++;
+	if (*player == PROTOCOL_ESCAPE_PLAYER) {
+		u64 value;
+		if (!read_varint_checked(p, end, &value) || value >= MAX_SNAKES)
+			return false;
+		*player = value;
+	}
+	return *player < MAX_SNAKES;
+}
+
+// Writes the message to dst, which has room for
+// PROTOCOL_MAX_MESSAGE_SIZE bytes, and returns its size. base is the
+// frame deltas count from on the connection.
+int encode_message(u8 *dst, u64 *base, ProtocolMessage *msg)
+{
+	u8 *p = dst;
+	*p++ = msg->type;
+
+	if (message_has_frame(msg->type)) {
+		p += write_varint(p, zigzag_encode((s64) (msg->frame_index - *base)));
+		*base = msg->frame_index;
+	}
+
+	switch (msg->type) {
+
+		case MESSAGE_INPUT:
+		p += write_player_dir(p, msg->player, msg->dir);
+		break;
+
+		case MESSAGE_STATE_HASH:
+		{
+			u64 hash = htonll(msg->hash);
+			memcpy(p, &hash, sizeof(hash));
+			p += sizeof(hash);
+		}
+		break;
+
+		case MESSAGE_SYNC:
+		case MESSAGE_PING:
+		case MESSAGE_PONG:
+		p += write_varint(p, msg->time_us);
+		break;
+	}
+	return p - dst;
+}
+
+// Reads a message from the len bytes at src and returns its size, or 0
+// if it's cut short or malformed. base only moves for messages read.
+int decode_message(u8 *src, int len, u64 *base, ProtocolMessage *msg)
+{
+	u8 *p = src;
+	u8 *end = src + len;
+	u64 value;
+
+	if (len < 1) return 0;
+	*msg = (ProtocolMessage) {.type=*p++};
+
+	if (message_has_frame(msg->type)) {
+		if (!read_varint_checked(&p, end, &value))
+			return 0;
+		msg->frame_index = *base + zigzag_decode(value);
+	}
+
+	switch (msg->type) {
+
+		case MESSAGE_INPUT:
+		if (!read_player_dir(&p, end, &msg->player, &msg->dir))
+			return 0;
+		break;
+
+		case MESSAGE_STATE_HASH:
+		if (end - p < sizeof(msg->hash)) return 0;
+		memcpy(&msg->hash, p, sizeof(msg->hash));
+		msg->hash = ntohll(msg->hash);
+		p += sizeof(msg->hash);
+		break;
+
+		case MESSAGE_SYNC:
+		case MESSAGE_PING:
+		case MESSAGE_PONG:
+		if (!read_varint_checked(&p, end, &msg->time_us))
+			return 0;
+		break;
+
+		default:
+		return 0;
+	}
+
+	if (message_has_frame(msg->type))
+		*base = msg->frame_index;
+	return p - src;
+}
+
+// The inputs sent over a connection in input packets, and the ones
+// received from it
+typedef struct {
+	ByteQueue unacked; // Inputs the peer didn't acknowledge yet, oldest first
+	u32 unacked_seq;   // Number of the oldest of them
+	u32 recv_seq;      // Number of the next input expected
+	bool ack_due;      // Inputs came since the last packet sent
+} InputChannel;
+
+void input_channel_init(InputChannel *ch)
+{
+	byte_queue_init(&ch->unacked);
+	ch->unacked_seq = 0;
+	ch->recv_seq = 0;
+	ch->ack_due = false;
+}
+
+void input_channel_reset(InputChannel *ch)
+{
+	byte_queue_reset(&ch->unacked);
+	input_channel_init(ch);
+}
+
+int input_channel_num_unacked(InputChannel *ch)
+{
+	return byte_queue_used_space(&ch->unacked) / sizeof(Input);
+}
+
+void input_channel_push(InputChannel *ch, Input input)
+{
+	if (!byte_queue_ensure_min_free_space(&ch->unacked, sizeof(input))) {
+		printf("OUT OF MEMORY\n");
+		abort();
+	}
+	memcpy(byte_queue_start_write(&ch->unacked), &input, sizeof(input));
+	byte_queue_end_write(&ch->unacked, sizeof(input));
+}
+
+// Writes the next packet to dst, which has room for
+// INPUT_PACKET_MAX_SIZE bytes, and returns its size. 0 if there's
+// nothing to send or acknowledge.
+int input_channel_write_packet(InputChannel *ch, u8 *dst)
+{
+	int count = MIN(input_channel_num_unacked(ch), INPUT_REDUNDANCY);
+	if (count == 0 && !ch->ack_due)
+		return 0;
+
+	u8 *p = dst;
+	*p++ = MESSAGE_INPUTS;
+	p += write_varint(p, ch->recv_seq);
+	p += write_varint(p, ch->unacked_seq);
+	p += write_varint(p, count);
+
+	char *src = byte_queue_start_read(&ch->unacked);
+	u64 base = 0;
+	for (int i = 0; i < count; i++) {
+		Input input;
+		memcpy(&input, src + i * sizeof(Input), sizeof(Input));
+		p += write_varint(p, zigzag_encode((s64) (input.time - base)));
+		p += write_player_dir(p, input.player, input.dir);
+		base = input.time;
+	}
+
+	ch->ack_due = false;
+	return p - dst;
+}
+
+// Reads the packet in the len bytes at src and drops the inputs it
+// acknowledges. The inputs it has that weren't received before go to
+// inputs, which has room for INPUT_REDUNDANCY of them. Returns their
+// number, or -1 if the packet is malformed.
+int input_channel_read_packet(InputChannel *ch, u8 *src, int len, Input *inputs)
+{
+	u8 *p = src + 1;
+	u8 *end = src + len;
+
+	u64 ack, first_seq, count;
+	if (len < 1 || src[0] != MESSAGE_INPUTS
+		|| !read_varint_checked(&p, end, &ack)
+		|| !read_varint_checked(&p, end, &first_seq)
+		|| !read_varint_checked(&p, end, &count)
+		|| ack > UINT32_MAX || first_seq > UINT32_MAX || count > INPUT_REDUNDANCY)
+		return -1;
+
+	// Packets that were overtaken carry older acks
+	u32 num_acked = (u32) ack - ch->unacked_seq;
+	if ((s32) num_acked > 0) {
+		if (num_acked > input_channel_num_unacked(ch))
+			return -1; // Acknowledges inputs never sent
+		byte_queue_end_read(&ch->unacked, num_acked * sizeof(Input));
+		ch->unacked_seq = ack;
+	}
+
+	int num_inputs = 0;
+	u64 frame_index = 0;
+	for (u32 i = 0; i < count; i++) {
+		u64 delta;
+		Input input = {0};
+		if (!read_varint_checked(&p, end, &delta) || !read_player_dir(&p, end, &input.player, &input.dir))
+			return -1;
+		frame_index += zigzag_decode(delta);
+		input.time = frame_index;
+
+		if ((u32) first_seq + i == ch->recv_seq) {
+			inputs[num_inputs++] = input;
+			ch->recv_seq++;
+		}
+	}
+	if (count > 0)
+		ch->ack_due = true;
+	return num_inputs;
+}
+
+typedef struct {
     u32 head_x;
     u32 head_y;
 } InitialSnakeStateMessage;
 
-typedef struct { // TODO: Make sure there is no padding
+typedef struct {
     u64 time_us;
     u64 seed;
     u32 num_snakes;
     u32 self_index;
-	char location[STEAM_PING_LOCATION_STRING_SIZE];
+    u32 world_w;
+    u32 world_h;
+	char location[NET_LOCATION_STRING_SIZE];
     InitialSnakeStateMessage snakes[MAX_SNAKES];
 } InitialGameStateMessage;
 
-bool is_server;
-bool multiplayer;
-
-u32 get_current_player_id(void);
-u64 get_current_frame_index(void);
-
-#if HAVE_MULTIPLAYER
-
+// Received messages are parsed where the transport keeps them. Every
+// message sent carries whole protocol messages, since client_update
+// sends what the output queue holds at the end of a frame, so a
+// protocol message never spans two of them.
 typedef struct {
-	SteamHandle handle;
-	ByteQueue input;
+	NetHandle handle;
+	NetMessage received[NET_RECEIVE_BATCH];
+	int num_received;
+	int current;    // Message being parsed
+	int offset;     // Bytes of it already parsed
 	ByteQueue output;
 	bool failed;
+	RttEstimate rtt;
+	u64 send_frame; // Frames the deltas of the protocol count from
+	u64 recv_frame;
+	InputChannel inputs;
 } ClientData;
 
 #define MAX_CLIENTS (MAX_SNAKES-1)
 
+Transport *net_transport;
 ClientData server_data;
 ClientData client_data[MAX_CLIENTS];
 
+// The server receives from all its clients at once through the poll
+// group of the transport, where each client's connection has its
+// index in client_data as user data. Messages are parsed in the order
+// they arrived, so a frame costs as much as the messages it got and
+// not as much as the clients connected.
+NetMessage polled[NET_RECEIVE_BATCH];
+int num_polled = 0;
+int polled_current = 0;
+int polled_offset = 0;
+
+// Set when a client may have failed, so the clients are only looked
+// through for failures when there can be one
+bool client_failed = false;
+
+// Inputs of the last input packet parsed, handed out one at a time
+Input received_inputs[INPUT_REDUNDANCY];
+int num_received_inputs = 0;
+int received_inputs_current = 0;
+
 void init_client_data(ClientData *client)
 {
-	client->handle = STEAM_HANDLE_INVALID;
+	client->handle = NET_HANDLE_INVALID;
 	client->failed = false;
-	byte_queue_init(&client->input);
+	client->rtt = (RttEstimate) {0};
+	client->send_frame = 0;
+	client->recv_frame = 0;
+	client->num_received = 0;
+	client->current = 0;
+	client->offset = 0;
 	byte_queue_init(&client->output);
+	input_channel_init(&client->inputs);
+}
+
+// Gives the messages received so far back to the transport
+void release_received_messages(ClientData *client)
+{
+	if (client->num_received > 0)
+		net_transport->release(net_transport, client->received, client->num_received);
+	client->num_received = 0;
+	client->current = 0;
+	client->offset = 0;
 }
 
 void reset_client_data(ClientData *client)
 {
-	if (client->handle != STEAM_HANDLE_INVALID) {
+	release_received_messages(client);
+	if (client->handle != NET_HANDLE_INVALID) {
 		printf("CLIENT RESET\n");
-		steam_close_accepted_connection(client->handle);
+		net_transport->close_accepted_connection(net_transport, client->handle);
 	}
 
-	client->handle = STEAM_HANDLE_INVALID;
+	client->handle = NET_HANDLE_INVALID;
 	client->failed = false;
+	client->rtt = (RttEstimate) {0};
+	client->send_frame = 0;
+	client->recv_frame = 0;
 
-	byte_queue_reset(&client->input);
 	byte_queue_reset(&client->output);
+	input_channel_reset(&client->inputs);
 }
 
-bool net_init(void)
+void net_init(Transport *transport)
 {
+	net_transport = transport;
 	init_client_data(&server_data);
 	for (int i = 0; i < MAX_CLIENTS; i++)
 		init_client_data(&client_data[i]);
-	return steam_init(480);
+}
+
+void release_polled_messages(void)
+{
+	if (num_polled > 0)
+		net_transport->release(net_transport, polled, num_polled);
+	num_polled = 0;
+	polled_current = 0;
+	polled_offset = 0;
 }
 
 void net_free(void)
 {
-	steam_free();
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		release_received_messages(&client_data[i]);
+	release_received_messages(&server_data);
+	release_polled_messages();
+	net_transport->free(net_transport);
 }
 
 void net_reset(void)
 {
 	printf("NET RESET\n");
+	release_polled_messages();
 	for (int i = 0; i < MAX_CLIENTS; i++)
 		reset_client_data(&client_data[i]);
 	reset_client_data(&server_data);
-	steam_reset();
+	client_failed = false;
+	num_received_inputs = 0;
+	received_inputs_current = 0;
+	net_transport->reset(net_transport);
 }
 
 void client_update(ClientData *client)
 {
 	if (client->failed) printf("UPDATING FAILED CLIENT\n");
 
-	if (client->handle != STEAM_HANDLE_INVALID && !client->failed) {
-
-		{
-			char *src = byte_queue_start_read(&client->output);
-			int   len = byte_queue_used_space(&client->output);
-			if (len > 0) {
-				if (!steam_send(client->handle, src, len))
-					client->failed = true;
-				else
-					byte_queue_end_read(&client->output, len);
-			}
+	if (client->handle != NET_HANDLE_INVALID && !client->failed) {
+		char *src = byte_queue_start_read(&client->output);
+		int   len = byte_queue_used_space(&client->output);
+		if (len > 0) {
+			if (!net_transport->send(net_transport, client->handle, src, len)) {
+				client->failed = true;
+				client_failed = true;
+			} else
+				byte_queue_end_read(&client->output, len);
 		}
 
-		if (!client->failed) {
-
-			int len;
-			char *src = steam_recv(client->handle, &len);
-
-			if (len > 0) {
-				if (!byte_queue_ensure_min_free_space(&client->input, len))
-					client->failed = true;
-				else {
-					char *dst = byte_queue_start_write(&client->input);
-					memcpy(dst, src, len);
-					byte_queue_end_write(&client->input, len);
-					steam_consume(client->handle);
-				}
-			}
+		u8 packet[INPUT_PACKET_MAX_SIZE];
+		len = input_channel_write_packet(&client->inputs, packet);
+		if (len > 0 && !net_transport->send_unreliable(net_transport, client->handle, packet, len)) {
+			client->failed = true;
+			client_failed = true;
 		}
 	}
 }
@@ -134,12 +516,13 @@ void client_update(ClientData *client)
 void net_update(void)
 {
 	// Mark all disconnected clients as "failed"
-	SteamHandle handle;
-	while ((handle = steam_get_disconnect_message()) != STEAM_HANDLE_INVALID) {
+	NetHandle handle;
+	while ((handle = net_transport->get_disconnect_message(net_transport)) != NET_HANDLE_INVALID) {
 		for (int i = 0; i < MAX_CLIENTS; i++) {
 			if (client_data[i].handle == handle) {
 				printf("Snake disconnected\n");
 				client_data[i].failed = true;
+				client_failed = true;
 				break;
 			}
 		}
@@ -148,26 +531,35 @@ void net_update(void)
 	for (int i = 0; i < MAX_CLIENTS; i++)
 		client_update(&client_data[i]);
 	client_update(&server_data);
-	steam_update();
+	net_transport->update(net_transport);
 }
 
-uint32_t net_accept(void)
+NetHandle net_accept(void)
 {
-	SteamHandle handle = steam_accept_connection();
+	NetHandle handle = net_transport->accept_connection(net_transport);
+	if (handle == NET_HANDLE_INVALID)
+		return NET_HANDLE_INVALID;
 	int i = 0;
-	while (i < MAX_CLIENTS && client_data[i].handle != STEAM_HANDLE_INVALID)
+	while (i < MAX_CLIENTS && client_data[i].handle != NET_HANDLE_INVALID)
 		i++;
-	if (i == MAX_CLIENTS)
-		return STEAM_HANDLE_SERVER;
+	if (i == MAX_CLIENTS) {
+		// No room for another player
+		net_transport->close_accepted_connection(net_transport, handle);
+		return NET_HANDLE_SERVER;
+	}
+	if (!net_transport->join_poll_group(net_transport, handle, i)) {
+		net_transport->close_accepted_connection(net_transport, handle);
+		return NET_HANDLE_SERVER;
+	}
 	ClientData *client = &client_data[i];
 	client->handle = handle;
 	// TODO: Init client data
 	return handle;
 }
 
-ClientData *get_client_data_from_steam_handle(uint32_t handle)
+ClientData *get_client_data_from_handle(NetHandle handle)
 {
-	if (handle == STEAM_HANDLE_SERVER)
+	if (handle == NET_HANDLE_SERVER)
 		return &server_data;
 	for (int i = 0; i < MAX_CLIENTS; i++)
 		if (client_data[i].handle == handle)
@@ -176,14 +568,13 @@ ClientData *get_client_data_from_steam_handle(uint32_t handle)
 	return NULL;
 }
 
-bool net_failed(uint32_t conn)
+bool net_failed(NetHandle conn)
 {
-	return get_client_data_from_steam_handle(conn)->failed;
+	return get_client_data_from_handle(conn)->failed;
 }
 
-void net_write(uint32_t conn, void *msg, int len)
+void client_write(ClientData *client, void *msg, int len)
 {
-	ClientData *client = get_client_data_from_steam_handle(conn);
 	if (client->failed) return;
 
 	if (!byte_queue_ensure_min_free_space(&client->output, len)) {
@@ -195,41 +586,72 @@ void net_write(uint32_t conn, void *msg, int len)
 	byte_queue_end_write(&client->output, len);
 }
 
-string net_peekmsg(uint32_t conn)
+void client_write_message(ClientData *client, ProtocolMessage *msg)
+{
+	u8 buffer[PROTOCOL_MAX_MESSAGE_SIZE];
+	int len = encode_message(buffer, &client->send_frame, msg);
+	client_write(client, buffer, len);
+}
+
+void net_write(NetHandle conn, void *msg, int len)
 {
-	ClientData *client = get_client_data_from_steam_handle(conn);
-	if (client->failed) return (string) {.data=NULL, .count=0};
-	return (string) {
-		.data = (u8*) byte_queue_start_read(&client->input),
-		.count = byte_queue_used_space(&client->input),
-	};
+	client_write(get_client_data_from_handle(conn), msg, len);
 }
 
-void net_popmsg(uint32_t conn, size_t len)
+void net_write_varint(NetHandle conn, u64 value)
 {
-	byte_queue_end_read(&get_client_data_from_steam_handle(conn)->input, len);
+	u8 buffer[10];
+	net_write(conn, buffer, write_varint(buffer, value));
+}
+
+// The unparsed part of the current message. Once every message was
+// parsed they are released and the next batch is received.
+string net_peekmsg(NetHandle conn)
+{
+	ClientData *client = get_client_data_from_handle(conn);
+	for (;;) {
+		if (client->failed) return (string) {.data=NULL, .count=0};
+
+		while (client->current < client->num_received && client->offset == client->received[client->current].size) {
+			client->current++;
+			client->offset = 0;
+		}
+
+		if (client->current < client->num_received) {
+			NetMessage *msg = &client->received[client->current];
+			return (string) {.data=msg->data + client->offset, .count=msg->size - client->offset};
+		}
+
+		release_received_messages(client);
+		int n = net_transport->receive(net_transport, client->handle, client->received, NET_RECEIVE_BATCH);
+		if (n < 0)
+			client->failed = true;
+		else if (n == 0)
+			return (string) {.data=NULL, .count=0};
+		else
+			client->num_received = n;
+	}
+}
+
+void net_popmsg(NetHandle conn, size_t len)
+{
+	get_client_data_from_handle(conn)->offset += len;
 }
 
 bool net_listen_start(void)
 {
-	return steam_listen_start();
+	return net_transport->listen_start(net_transport);
 }
 
 void net_listen_stop(void)
 {
-	steam_listen_stop();
+	net_transport->listen_stop(net_transport);
 }
 
-enum {
-	CONNECT_OK = 0,
-	CONNECT_FAILED = -1,
-	CONNECT_PENDING = 1,
-};
-
 bool net_connect_start(uint64_t peer_id)
 {
-	if (steam_connect_start(peer_id)) {
-		server_data.handle = STEAM_HANDLE_SERVER;
+	if (net_transport->connect_start(net_transport, peer_id)) {
+		server_data.handle = NET_HANDLE_SERVER;
 		return true;
 	}
 	return false;
@@ -237,12 +659,12 @@ bool net_connect_start(uint64_t peer_id)
 
 void net_connect_stop(void)
 {
-	steam_connect_stop();
+	net_transport->connect_stop(net_transport);
 }
 
 int net_connect_status(void)
 {
-	return steam_connect_status();
+	return net_transport->connect_status(net_transport);
 }
 
 // Results:
@@ -257,29 +679,22 @@ bool wait_for_players(void);
 
 void broadcast_input_to_clients(Input input)
 {
-    // NOTE: We can only change the fields in place because
-    //       the argument is a copy!!!
-    input.time   = htonll(input.time);
-    input.dir    = htonl(input.dir);
-    input.player = htonl(input.player);
-
-	uint8_t type = MESSAGE_INPUT;
-    for (u32 i = 0; i < MAX_CLIENTS; i++) {
-        if (client_data[i].handle != STEAM_HANDLE_INVALID) {
-			net_write(client_data[i].handle, &type,         sizeof(type));
-            net_write(client_data[i].handle, &input.time,   sizeof(input.time));
-            net_write(client_data[i].handle, &input.player, sizeof(input.player));
-            net_write(client_data[i].handle, &input.dir,    sizeof(input.dir));
-        }
-    }
+	ProtocolMessage msg = {.type=MESSAGE_INPUT, .frame_index=input.time, .player=input.player, .dir=input.dir};
+	for (u32 i = 0; i < MAX_CLIENTS; i++) {
+		if (client_data[i].handle == NET_HANDLE_INVALID)
+			continue;
+		if (redundant_inputs)
+			input_channel_push(&client_data[i].inputs, (Input) {.time=input.time, .player=input.player, .dir=input.dir});
+		else
+			client_write_message(&client_data[i], &msg);
+	}
 }
 
-
 int count_client_handles(void)
 {
     int n = 0;
     for (int i = 0; i < MAX_CLIENTS; i++)
-        if (client_data[i].handle != STEAM_HANDLE_INVALID)
+        if (client_data[i].handle != NET_HANDLE_INVALID)
             n++;
     return n;
 }
@@ -290,12 +705,19 @@ void compact_client_handles(void)
 
     for (int i = 0; i < MAX_CLIENTS; i++) {
         client_data_copy[i] = client_data[i];
-        client_data[i].handle = STEAM_HANDLE_INVALID;
+        client_data[i].handle = NET_HANDLE_INVALID;
     }
 
-    for (int i = 0, j = 0; i < MAX_CLIENTS; i++)
-        if (client_data_copy[i].handle != STEAM_HANDLE_INVALID)
-            client_data[j++] = client_data_copy[i];
+    for (int i = 0, j = 0; i < MAX_CLIENTS; i++) {
+        if (client_data_copy[i].handle != NET_HANDLE_INVALID) {
+            client_data[j] = client_data_copy[i];
+            if (i != j && !net_transport->join_poll_group(net_transport, client_data[j].handle, j)) {
+                client_data[j].failed = true;
+                client_failed = true;
+            }
+            j++;
+        }
+    }
 }
 
 void send_local_input(Input input)
@@ -304,126 +726,313 @@ void send_local_input(Input input)
 
     if (is_server) {
         broadcast_input_to_clients(input);
+    } else if (redundant_inputs) {
+        input_channel_push(&server_data.inputs, (Input) {.time=input.time, .dir=input.dir});
     } else {
-        // NOTE: We can only change the fields in place because
-        //       the argument is a copy!!!
-        input.time = htonll(input.time);
-        input.dir  = htonl(input.dir);
-
-        net_write(STEAM_HANDLE_SERVER, &input.time, sizeof(input.time));
-        net_write(STEAM_HANDLE_SERVER, &input.dir,  sizeof(input.dir));
+        ProtocolMessage msg = {.type=MESSAGE_INPUT, .frame_index=input.time, .dir=input.dir};
+        client_write_message(&server_data, &msg);
     }
 }
 
-bool get_client_input_from_network(Input *input)
+// The server sends its hashes to all clients, while clients only
+// send theirs to the server.
+void send_state_hash(u64 frame_index, u64 hash)
+{
+	ProtocolMessage msg = {.type=MESSAGE_STATE_HASH, .frame_index=frame_index, .hash=hash};
+	if (is_server) {
+		for (u32 i = 0; i < MAX_CLIENTS; i++)
+			if (client_data[i].handle != NET_HANDLE_INVALID)
+				client_write_message(&client_data[i], &msg);
+	} else
+		client_write_message(&server_data, &msg);
+}
+
+void send_ping_message(ClientData *peer, u8 type, u64 time_us)
 {
-	static int cursor = 0;
+	ProtocolMessage msg = {.type=type, .time_us=time_us};
+	client_write_message(peer, &msg);
+}
 
-	while (cursor < MAX_CLIENTS) {
+// The server pings every client, clients only ping the server
+void send_pings(void)
+{
+	u64 time = net_get_time_us();
+	if (is_server) {
+		for (u32 i = 0; i < MAX_CLIENTS; i++)
+			if (client_data[i].handle != NET_HANDLE_INVALID)
+				send_ping_message(&client_data[i], MESSAGE_PING, time);
+	} else
+		send_ping_message(&server_data, MESSAGE_PING, time);
+}
+
+// Pings are sent back as they are, pongs carry the time their ping
+// was sent
+void receive_ping_message(ClientData *peer, u8 type, u64 time_us)
+{
+	if (type == MESSAGE_PING)
+		send_ping_message(peer, MESSAGE_PONG, time_us);
+	else
+		add_rtt_sample(&peer->rtt, (float64) (net_get_time_us() - time_us));
+}
+
+// Latency to the other peers. The server takes its slowest client, as
+// inputs of every player go through it. Returns false until there's
+// a measurement.
+bool get_connection_rtt(RttEstimate *rtt)
+{
+	if (!is_server) {
+		*rtt = server_data.rtt;
+		return rtt->measured;
+	}
 
-		if (client_data[cursor].handle == STEAM_HANDLE_INVALID) {
-			cursor++;
+	*rtt = (RttEstimate) {0};
+	for (u32 i = 0; i < MAX_CLIENTS; i++) {
+		RttEstimate *client = &client_data[i].rtt;
+		if (client_data[i].handle == NET_HANDLE_INVALID || !client->measured)
 			continue;
+		rtt->measured = true;
+		rtt->srtt_us = MAX(rtt->srtt_us, client->srtt_us);
+		rtt->jitter_us = MAX(rtt->jitter_us, client->jitter_us);
+	}
+	return rtt->measured;
+}
+
+// The unparsed part of the current message from the clients, and the
+// index of the client that sent it. Once every message was parsed they
+// are released and the next batch is received from the poll group.
+string net_peek_client_message(int *index)
+{
+	for (;;) {
+		while (polled_current < num_polled && polled_offset == polled[polled_current].size) {
+			polled_current++;
+			polled_offset = 0;
+		}
+
+		if (polled_current < num_polled) {
+			NetMessage *msg = &polled[polled_current];
+			*index = (int) msg->user_data;
+			return (string) {.data=msg->data + polled_offset, .count=msg->size - polled_offset};
 		}
 
-		u32 player_id = cursor+1;
+		release_polled_messages();
+		int n = net_transport->receive_on_poll_group(net_transport, polled, NET_RECEIVE_BATCH);
+		if (n <= 0)
+			return (string) {.data=NULL, .count=0};
+		num_polled = n;
+	}
+}
+
+void net_pop_client_message(size_t len)
+{
+	polled_offset += len;
+}
+
+bool pop_received_input(Input *input)
+{
+	if (received_inputs_current == num_received_inputs)
+		return false;
+	*input = received_inputs[received_inputs_current++];
+	return true;
+}
+
+// Reads an input packet into received_inputs. Returns false if it's
+// malformed.
+bool receive_input_packet(InputChannel *ch, string packet)
+{
+	int n = input_channel_read_packet(ch, packet.data, packet.count, received_inputs);
+	num_received_inputs = MAX(n, 0);
+	received_inputs_current = 0;
+	return n >= 0;
+}
 
-		if (net_failed(client_data[cursor].handle)) {
+bool get_client_input_from_network(Input *input)
+{
+	if (client_failed) {
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			if (client_data[i].handle == NET_HANDLE_INVALID || !client_data[i].failed)
+				continue;
 			printf("CLIENT ERROR\n");
-			*input = (Input) {.time=get_current_frame_index(), .player=player_id, .dir=DIR_LEFT, .disconnect=true};
-			reset_client_data(&client_data[cursor]);
+			*input = (Input) {.time=get_current_frame_index(), .player=i+1, .dir=DIR_LEFT, .disconnect=true};
+			reset_client_data(&client_data[i]);
 			return true;
 		}
+		client_failed = false;
+	}
+
+	for (;;) {
 
-		string msg = net_peekmsg(client_data[cursor].handle);
-        if (msg.count < sizeof(u64) + sizeof(u32)) {
-			cursor++;
-            continue;
+		if (pop_received_input(input)) {
+			// Skip the rest of a packet from a client that's gone
+			ClientData *client = &client_data[input->player-1];
+			if (client->handle == NET_HANDLE_INVALID || client->failed)
+				continue;
+			if (!can_apply_input(*input)) {
+				printf("Input from client is out of the rollback window\n");
+				client->failed = true;
+				client_failed = true;
+				continue;
+			}
+			broadcast_input_to_clients(*input);
+			return true;
 		}
 
-        u32 value;
-        u64 time;
-        memcpy(&time,  msg.data + 0, sizeof(u64));
-        memcpy(&value, msg.data + 8, sizeof(u32));
-        net_popmsg(client_data[cursor].handle, sizeof(u64) + sizeof(u32));
-        Direction dir = ntohl(value);
-        time = ntohll(time);
+		int index;
+		string msg = net_peek_client_message(&index);
+		if (msg.count == 0)
+			return false;
 
-        input->dir = dir;
-        input->disconnect = false;
-        input->player = player_id;
-        input->time = time;
+		// What's left of clients that are gone
+		if (index < 0 || index >= MAX_CLIENTS || client_data[index].handle == NET_HANDLE_INVALID || client_data[index].failed) {
+			net_pop_client_message(msg.count);
+			continue;
+		}
 
-        broadcast_input_to_clients(*input);
-        return true;
-	}
+		ClientData *client = &client_data[index];
+		u32 player_id = index+1;
 
-	cursor = 0;
-	return false;
+		u8 type = msg.data[0];
+		if (type != MESSAGE_INPUT && type != MESSAGE_INPUTS && type != MESSAGE_STATE_HASH && type != MESSAGE_PING && type != MESSAGE_PONG) {
+			printf("Bad message type from client (type %d)\n", type);
+			net_pop_client_message(msg.count);
+			client->failed = true;
+			client_failed = true;
+			continue;
+		}
+
+		// Input packets are transport messages of their own
+		if (type == MESSAGE_INPUTS) {
+			net_pop_client_message(msg.count);
+			if (!receive_input_packet(&client->inputs, msg)) {
+				printf("Malformed input packet from client\n");
+				client->failed = true;
+				client_failed = true;
+			}
+			for (int i = 0; i < num_received_inputs; i++)
+				received_inputs[i].player = player_id;
+			continue;
+		}
+
+		// Protocol messages never span transport messages, so one
+		// that is cut short will never be completed. The client is
+		// dropped the next time inputs are polled.
+		ProtocolMessage m;
+		int size = decode_message(msg.data, msg.count, &client->recv_frame, &m);
+		if (size == 0) {
+			printf("Malformed message from client (type %d)\n", type);
+			net_pop_client_message(msg.count);
+			client->failed = true;
+			client_failed = true;
+			continue;
+		}
+		net_pop_client_message(size);
+
+		if (type == MESSAGE_STATE_HASH) {
+			receive_state_hash(player_id, m.frame_index, m.hash);
+			continue;
+		}
+
+		if (type == MESSAGE_PING || type == MESSAGE_PONG) {
+			receive_ping_message(client, type, m.time_us);
+			continue;
+		}
+
+		input->dir = m.dir;
+		input->disconnect = false;
+		input->player = player_id;
+		input->time = m.frame_index;
+
+		if (!can_apply_input(*input)) {
+			printf("Input from client is out of the rollback window\n");
+			client->failed = true;
+			client_failed = true;
+			continue;
+		}
+		broadcast_input_to_clients(*input);
+		return true;
+	}
 }
 
 bool get_server_input_from_network(Input *input, SyncMessage *msg)
 {
-	string input_buffer;
 	for (;;) {
 
-		if (net_failed(STEAM_HANDLE_SERVER)) {
+		if (net_failed(NET_HANDLE_SERVER)) {
 			printf("SERVER ERROR\n");
 			*input = (Input) {.time=get_current_frame_index(), .player=0, .dir=DIR_LEFT, .disconnect=true};
 			reset_client_data(&server_data);
 			return true;
 		}
 
-		input_buffer = net_peekmsg(STEAM_HANDLE_SERVER);
+		if (pop_received_input(input)) {
+			if (!can_apply_input(*input)) {
+				printf("Input from server is out of the rollback window\n");
+				server_data.failed = true;
+				continue;
+			}
+			return true;
+		}
 
-		if (input_buffer.count < sizeof(u8) + 2 * sizeof(u64))
-			break;
+		string input_buffer = net_peekmsg(NET_HANDLE_SERVER);
+		if (input_buffer.count == 0)
+			return false;
 
-		u8 type;
-		memcpy(&type, input_buffer.data + 0, sizeof(u8));
-		if (type != MESSAGE_SYNC) break;
+		u8 type = input_buffer.data[0];
+		if (type != MESSAGE_INPUT && type != MESSAGE_INPUTS && type != MESSAGE_SYNC && type != MESSAGE_STATE_HASH && type != MESSAGE_PING && type != MESSAGE_PONG) {
+			printf("Bad message type from server (type %d)\n", type);
+			net_popmsg(NET_HANDLE_SERVER, input_buffer.count);
+			server_data.failed = true;
+			continue;
+		}
 
-		u64 frame_index;
-		u64 time;
-		memcpy(&frame_index,  input_buffer.data + 1, sizeof(u64));
-		memcpy(&time,         input_buffer.data + 9, sizeof(u64));
+		if (type == MESSAGE_INPUTS) {
+			net_popmsg(NET_HANDLE_SERVER, input_buffer.count);
+			if (!receive_input_packet(&server_data.inputs, input_buffer)) {
+				printf("Malformed input packet from server\n");
+				server_data.failed = true;
+			}
+			continue;
+		}
 
-		msg->empty = false;
-		msg->frame_index = ntohll(frame_index);
-		msg->time = ntohll(time);
+		ProtocolMessage m;
+		int size = decode_message(input_buffer.data, input_buffer.count, &server_data.recv_frame, &m);
+		if (size == 0) {
+			printf("Malformed message from server (type %d)\n", type);
+			net_popmsg(NET_HANDLE_SERVER, input_buffer.count);
+			server_data.failed = true;
+			continue;
+		}
+		net_popmsg(NET_HANDLE_SERVER, size);
 
-		net_popmsg(STEAM_HANDLE_SERVER, sizeof(u8) + 2 * sizeof(u32) + sizeof(u64));
-	}
+		switch (type) {
 
-	if (input_buffer.count < 2 * sizeof(u32) + sizeof(u64))
-		return false;
+			case MESSAGE_PING:
+			case MESSAGE_PONG:
+			receive_ping_message(&server_data, type, m.time_us);
+			break;
 
-	u8 type;
-	memcpy(&type, input_buffer.data + 0, sizeof(u8));
-	if (type != MESSAGE_INPUT) {
-		printf("Bad message type from server (type %d)\n", type);
-		abort();
-	}
+			case MESSAGE_STATE_HASH:
+			receive_state_hash(0, m.frame_index, m.hash);
+			break;
 
-	u64 time;
-	u32 buffer0;
-	u32 buffer1;
-	memcpy(&time,    input_buffer.data + 1, sizeof(u64));
-	memcpy(&buffer0, input_buffer.data + 9, sizeof(u32));
-	memcpy(&buffer1, input_buffer.data + 13, sizeof(u32));
-	net_popmsg(STEAM_HANDLE_SERVER, sizeof(u8) + 2 * sizeof(u32) + sizeof(u64));
-
-	time = ntohll(time);
-	u32 id = ntohl(buffer0);
-	Direction dir = ntohl(buffer1);
-
-	// TODO: Validate the ID
-
-	input->dir = dir;
-	input->disconnect = false;
-	input->player = id;
-	input->time = time;
-	return true;
+			case MESSAGE_SYNC:
+			msg->empty = false;
+			msg->frame_index = m.frame_index;
+			msg->time = m.time_us;
+			break;
+
+			case MESSAGE_INPUT:
+			input->dir = m.dir;
+			input->disconnect = false;
+			input->player = m.player;
+			input->time = m.frame_index;
+			if (!can_apply_input(*input)) {
+				printf("Input from server is out of the rollback window\n");
+				server_data.failed = true;
+				continue;
+			}
+			return true;
+		}
+	}
 }
 
 // -1 if not waiting for players
@@ -450,7 +1059,7 @@ void stop_waiting_for_players(void)
 bool wait_for_players(void)
 {
 	assert(num_players_to_wait >= 0);
-	while (net_accept() != STEAM_HANDLE_INVALID);
+	while (net_accept() != NET_HANDLE_INVALID);
 
 	// TODO: Handle disconnect
 
@@ -464,37 +1073,68 @@ bool wait_for_players(void)
 // Results:
 //   0  No message
 //   1  Message received
-//  -1  Server disconnected
+//  -1  Server disconnected, or speaks another protocol
 int poll_for_initial_state(InitialGameStateMessage *initial)
 {
 	// TODO: Handle server disconnect
 
-	string input_buffer = net_peekmsg(STEAM_HANDLE_SERVER);
+	string input_buffer = net_peekmsg(NET_HANDLE_SERVER);
+	if (input_buffer.count == 0)
+		return 0;
 
-	if (input_buffer.count < 2 * sizeof(u64) + 2 * sizeof(u32) + STEAM_PING_LOCATION_STRING_SIZE)
+	// Inputs that overtook the initial state. They're sent again until
+	// they're acknowledged.
+	if (input_buffer.data[0] == MESSAGE_INPUTS) {
+		net_popmsg(NET_HANDLE_SERVER, input_buffer.count);
 		return 0;
+	}
 
-	memcpy(initial, input_buffer.data, 2 * sizeof(u64) +  2 * sizeof(u32));
-	initial->time_us    = ntohll(initial->time_us);
-	initial->seed       = ntohll(initial->seed);
-	initial->num_snakes = ntohl(initial->num_snakes);
-	initial->self_index = ntohl(initial->self_index);
+	u8 *p = input_buffer.data;
+	u8 *end = p + input_buffer.count;
 
-	if (input_buffer.count < 2 * sizeof(u64) + 2 * sizeof(u32) + STEAM_PING_LOCATION_STRING_SIZE + initial->num_snakes * sizeof(InitialSnakeStateMessage))
-		return 0;
+	u64 version = 0;
+	if (!read_varint_checked(&p, end, &version) || version != NET_PROTOCOL_VERSION) {
+		printf("The server speaks protocol version %d, we speak %d\n", (int) version, NET_PROTOCOL_VERSION);
+		return -1;
+	}
+
+	u64 num_snakes, self_index, world_w, world_h, location_size;
+	bool ok = read_varint_checked(&p, end, &initial->time_us)
+		&& read_varint_checked(&p, end, &initial->seed)
+		&& read_varint_checked(&p, end, &num_snakes)
+		&& read_varint_checked(&p, end, &self_index)
+		&& read_varint_checked(&p, end, &world_w)
+		&& read_varint_checked(&p, end, &world_h)
+		&& read_varint_checked(&p, end, &location_size)
+		&& num_snakes <= MAX_SNAKES
+		&& self_index < num_snakes
+		&& world_w <= MAX_WORLD_W && world_h <= MAX_WORLD_H
+		&& location_size < NET_LOCATION_STRING_SIZE
+		&& location_size <= end - p;
+	if (!ok) {
+		printf("Bad initial state from the server\n");
+		return -1;
+	}
 
-	memcpy(initial, input_buffer.data, sizeof(InitialGameStateMessage));
-	initial->time_us    = ntohll(initial->time_us);
-	initial->seed       = ntohll(initial->seed);
-	initial->num_snakes = ntohl(initial->num_snakes);
-	initial->self_index = ntohl(initial->self_index);
+	initial->num_snakes = num_snakes;
+	initial->self_index = self_index;
+	initial->world_w = world_w;
+	initial->world_h = world_h;
+	memcpy(initial->location, p, location_size);
+	initial->location[location_size] = '\0';
+	p += location_size;
 
 	for (int i = 0; i < initial->num_snakes; i++) {
-		initial->snakes[i].head_x = ntohl(initial->snakes[i].head_x);
-		initial->snakes[i].head_y = ntohl(initial->snakes[i].head_y);
+		u64 head_x, head_y;
+		if (!read_varint_checked(&p, end, &head_x) || !read_varint_checked(&p, end, &head_y) || head_x >= world_w || head_y >= world_h) {
+			printf("Bad initial state from the server\n");
+			return -1;
+		}
+		initial->snakes[i].head_x = head_x;
+		initial->snakes[i].head_y = head_y;
 	}
 
-	net_popmsg(STEAM_HANDLE_SERVER, 2 * sizeof(u64) + 2 * sizeof(u32) + STEAM_PING_LOCATION_STRING_SIZE + initial->num_snakes * sizeof(InitialSnakeStateMessage));
+	net_popmsg(NET_HANDLE_SERVER, p - input_buffer.data);
 	return 1;
 }
 
@@ -515,6 +1155,8 @@ void input_globals_init(void)
 	last_input_frame = 0;
 }
 
+#ifndef OOGABOOGA_HEADLESS
+
 void poll_for_inputs(void)
 {
     up_press    = is_key_just_pressed(KEY_ARROW_UP);
@@ -531,6 +1173,8 @@ void poll_for_inputs(void)
 bool get_local_input(Input *input)
 {
 	u64 input_time = get_current_frame_index();
+	if (multiplayer)
+		input_time += input_delay_frames;
 
 	if (input_time <= last_input_frame)
 		input_time = last_input_frame+1;
@@ -595,3 +1239,5 @@ bool get_local_input(Input *input)
 
     return have_input;
 }
+
+#endif /* OOGABOOGA_HEADLESS */
@@ -0,0 +1,424 @@
+/*
+ * Match replays. The simulation is deterministic, so the state a match
+ * started from and its inputs in frame order are enough to play it
+ * again, which makes recorded matches usable as regression tests and
+ * benchmark corpora.
+ *
+ * Everything is a varint unless noted:
+ *
+ *   "SNKR" (4 bytes) version world_w world_h multiplayer seed frame_index
+ *   num_snakes, then slot head_x head_y for each snake
+ *   events
+ *
+ * An event is (frame_delta << 1 | disconnect) followed by
+ * ((player + 1) << 2 | direction), where frame_delta counts from the
+ * frame of the previous event and direction is 2 bits, see
+ * direction_to_bits. The last event has player code REPLAY_END_PLAYER
+ * and marks the frame the match ended at. It's followed by the hash of
+ * the final state (8 bytes, little endian), which the player checks.
+ *
+ * To seek without playing from the start, the events are followed by
+ * a keyframe every REPLAY_KEYFRAME_INTERVAL frames, each a GameState
+ * encoded with encode_state_delta against the state the header sets
+ * up, then an index of them and a footer. These are fixed size and
+ * little endian:
+ *
+ *   index entry: frame state_offset state_size event_offset event_base (u64 each)
+ *   footer: index_offset (u64) end_frame (u64) num_keyframes (u32)
+ *           sizeof(GameState) (u32) "SNKI"
+ *
+ * event_offset is where the first event at or after the keyframe's
+ * frame starts and event_base the frame its delta counts from. The
+ * keyframes only fit builds with the same GameState, others play from
+ * the start.
+ *
+ * Other versions of the format are rejected.
+ */
+
+#define REPLAY_VERSION 1
+#define REPLAY_END_PLAYER 0 // Player code of the end marker
+#define REPLAY_INDEX_ENTRY_SIZE 40
+#define REPLAY_FOOTER_SIZE 28
+
+typedef struct {
+    ByteQueue data;
+    ByteQueue index;  // Index entries, until they're appended to data
+    bool active;      // False when the match started from a state replays can't hold
+    u64 last_frame;   // Frame of the last event, which deltas count from
+    u64 events_size;  // Bytes before the keyframes
+} ReplayRecorder;
+
+typedef struct {
+    u8 *data;
+    u64 size;
+    u8 *cursor;
+    u8 *end;          // End of the events and keyframes
+    u64 last_frame;
+    bool ended;       // Whether the end marker was read
+    u64 end_frame;
+    u64 end_hash;
+
+    u8 *index;
+    u32 num_keyframes; // 0 when the replay has no usable index
+    u64 index_end_frame;
+} ReplayPlayer;
+
+void replay_write_bytes(ByteQueue *q, void *src, u64 len)
+{
+    if (!byte_queue_ensure_min_free_space(q, len)) {
+        printf("OUT OF MEMORY\n");
+        abort();
+    }
+    memcpy(byte_queue_start_write(q), src, len);
+    byte_queue_end_write(q, len);
+}
+
+void replay_write_u64(ByteQueue *q, u64 value)
+{
+    u8 bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = value >> (8 * i);
+    replay_write_bytes(q, bytes, sizeof(bytes));
+}
+
+void replay_write_u32(ByteQueue *q, u32 value)
+{
+    u8 bytes[4];
+    for (int i = 0; i < 4; i++)
+        bytes[i] = value >> (8 * i);
+    replay_write_bytes(q, bytes, sizeof(bytes));
+}
+
+u64 replay_read_u64(u8 *src)
+{
+    u64 value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (u64) src[i] << (8 * i);
+    return value;
+}
+
+u32 replay_read_u32(u8 *src)
+{
+    u32 value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (u32) src[i] << (8 * i);
+    return value;
+}
+
+void replay_write_varint(ReplayRecorder *rec, u64 value)
+{
+    if (!byte_queue_ensure_min_free_space(&rec->data, 10)) {
+        printf("OUT OF MEMORY\n");
+        abort();
+    }
+    int n = write_varint((u8*) byte_queue_start_write(&rec->data), value);
+    byte_queue_end_write(&rec->data, n);
+}
+
+// Starts a new recording from a state where no snake has a body yet,
+// like the ones set up by send_initial_state and start_client_game.
+// Other states can't be recorded and leave the recorder inactive.
+// Reuses the memory of the previous recording.
+void replay_record_start(ReplayRecorder *rec, GameState *game)
+{
+    byte_queue_end_read(&rec->data, byte_queue_used_space(&rec->data));
+    rec->last_frame = game->frame_index;
+    rec->events_size = 0;
+
+    rec->active = true;
+    for (int i = 0; i < MAX_SNAKES; i++)
+        if (game->snakes[i].used && game->snakes[i].body_len > 0)
+            rec->active = false;
+    if (!rec->active)
+        return;
+
+    replay_write_bytes(&rec->data, "SNKR", 4);
+    replay_write_varint(rec, REPLAY_VERSION);
+    replay_write_varint(rec, game->world_w);
+    replay_write_varint(rec, game->world_h);
+    replay_write_varint(rec, game->multiplayer);
+    replay_write_varint(rec, game->seed);
+    replay_write_varint(rec, game->frame_index);
+
+    replay_write_varint(rec, count_snakes(game));
+    for (int i = 0; i < MAX_SNAKES; i++) {
+        Snake *s = &game->snakes[i];
+        if (!s->used) continue;
+        replay_write_varint(rec, i);
+        replay_write_varint(rec, s->head_x);
+        replay_write_varint(rec, s->head_y);
+    }
+}
+
+void replay_write_event(ReplayRecorder *rec, u64 frame_index, bool disconnect, u32 player_code, u8 dir_bits)
+{
+    if (!rec->active)
+        return;
+    assert(frame_index >= rec->last_frame, "Replay events must be in frame order");
+    replay_write_varint(rec, (frame_index - rec->last_frame) << 1 | disconnect);
+    replay_write_varint(rec, (u64) player_code << 2 | dir_bits);
+    rec->last_frame = frame_index;
+}
+
+// Inputs must come in the order they are applied
+void replay_record_input(ReplayRecorder *rec, Input input)
+{
+    replay_write_event(rec, input.time, input.disconnect, input.player + 1, input.disconnect ? 0 : direction_to_bits(input.dir));
+}
+
+u8 *replay_data(ReplayRecorder *rec)
+{
+    return (u8*) byte_queue_start_read(&rec->data);
+}
+
+u64 replay_size(ReplayRecorder *rec)
+{
+    return byte_queue_used_space(&rec->data);
+}
+
+// Reads the header of a replay and sets up the state the match
+// started from. Returns false if the data isn't a replay or its world
+// doesn't fit this build.
+bool replay_open(ReplayPlayer *player, u8 *data, u64 size, GameState *game)
+{
+    player->data = data;
+    player->size = size;
+    player->cursor = data;
+    player->end = data + size;
+    player->num_keyframes = 0;
+
+    if (size < 4 || memcmp(data, "SNKR", 4))
+        return false;
+    player->cursor += 4;
+
+    u64 version, world_w, world_h, multiplayer, seed, frame_index, num_snakes;
+    if (!read_varint_checked(&player->cursor, player->end, &version) || version != REPLAY_VERSION
+     || !read_varint_checked(&player->cursor, player->end, &world_w) || world_w == 0 || world_w > MAX_WORLD_W
+     || !read_varint_checked(&player->cursor, player->end, &world_h) || world_h == 0 || world_h > MAX_WORLD_H
+     || !read_varint_checked(&player->cursor, player->end, &multiplayer)
+     || !read_varint_checked(&player->cursor, player->end, &seed)
+     || !read_varint_checked(&player->cursor, player->end, &frame_index)
+     || !read_varint_checked(&player->cursor, player->end, &num_snakes) || num_snakes > MAX_SNAKES)
+        return false;
+
+    // Cleared first so the bytes init_game_state leaves alone match the
+    // ones the keyframes were stored against
+    memset(game, 0, sizeof(GameState));
+    init_game_state_sized(game, multiplayer != 0, world_w, world_h);
+    for (u64 i = 0; i < num_snakes; i++) {
+        u64 slot, x, y;
+        if (!read_varint_checked(&player->cursor, player->end, &slot) || slot >= MAX_SNAKES
+         || !read_varint_checked(&player->cursor, player->end, &x) || x >= world_w
+         || !read_varint_checked(&player->cursor, player->end, &y) || y >= world_h)
+            return false;
+        init_snake(game, &game->snakes[slot], x, y);
+    }
+    game->seed = seed;
+    game->frame_index = frame_index;
+
+    player->last_frame = frame_index;
+    player->ended = false;
+
+    // The index is optional, and ignored when it was written by a build
+    // with another GameState
+    if (size < REPLAY_FOOTER_SIZE)
+        return true;
+    u8 *footer = data + size - REPLAY_FOOTER_SIZE;
+    if (memcmp(footer + 24, "SNKI", 4) || replay_read_u32(footer + 20) != sizeof(GameState))
+        return true;
+
+    u64 index_offset = replay_read_u64(footer);
+    u32 num_keyframes = replay_read_u32(footer + 16);
+    if (index_offset < (u64) (player->cursor - data) || index_offset > size - REPLAY_FOOTER_SIZE
+     || size - REPLAY_FOOTER_SIZE - index_offset != (u64) num_keyframes * REPLAY_INDEX_ENTRY_SIZE)
+        return false;
+
+    player->end = data + index_offset;
+    player->index = data + index_offset;
+    player->num_keyframes = num_keyframes;
+    player->index_end_frame = replay_read_u64(footer + 8);
+    return true;
+}
+
+// Reads the next event. Returns false at the end marker or if the data
+// is malformed, which ended tells apart.
+bool replay_next_input(ReplayPlayer *player, Input *input)
+{
+    u64 header, code;
+    if (!read_varint_checked(&player->cursor, player->end, &header)
+     || !read_varint_checked(&player->cursor, player->end, &code))
+        return false;
+
+    u64 frame_index = player->last_frame + (header >> 1);
+    player->last_frame = frame_index;
+
+    if (code >> 2 == REPLAY_END_PLAYER) {
+        if (player->end - player->cursor < 8)
+            return false;
+        player->ended = true;
+        player->end_frame = frame_index;
+        player->end_hash = replay_read_u64(player->cursor);
+        player->cursor += 8;
+        return false;
+    }
+    u64 index = (code >> 2) - 1;
+    if (index >= MAX_SNAKES)
+        return false;
+
+    *input = (Input) {.time=frame_index, .player=index, .dir=bits_to_direction(code), .disconnect=header & 1};
+    return true;
+}
+
+// Plays up to the start of the given frame, before its inputs are
+// applied, or to the end of the match if that's sooner. Returns false
+// if the data is malformed.
+bool replay_play_until(ReplayPlayer *player, GameState *game, u64 frame_index)
+{
+    Input input;
+    for (;;) {
+        u8 *cursor = player->cursor;
+        u64 last_frame = player->last_frame;
+        bool got_input = replay_next_input(player, &input);
+        if (!got_input && !player->ended)
+            return false;
+
+        if (!got_input || input.time >= frame_index) {
+            // Leave the event to whoever plays on
+            player->cursor = cursor;
+            player->last_frame = last_frame;
+            if (!got_input)
+                frame_index = MIN(frame_index, player->end_frame);
+            break;
+        }
+        while (game->frame_index < input.time)
+            update_game_instance(game);
+        apply_input_to_game_instance(game, input);
+    }
+    while (game->frame_index < frame_index)
+        update_game_instance(game);
+    return true;
+}
+
+// Moves to the start of the given frame, or to the end of the match if
+// it's past it, by loading the closest keyframe before it. That costs
+// at most REPLAY_KEYFRAME_INTERVAL frames of simulation however long
+// the match is. Replays with no index play from the start. Returns
+// false if the data is malformed.
+bool replay_seek(ReplayPlayer *player, u64 frame_index, GameState *game)
+{
+    if (player->num_keyframes == 0)
+        return replay_open(player, player->data, player->size, game)
+            && replay_play_until(player, game, frame_index);
+
+    frame_index = MIN(frame_index, player->index_end_frame);
+
+    // Last keyframe at or before the frame, or the first one
+    u32 low = 0, high = player->num_keyframes;
+    while (high - low > 1) {
+        u32 mid = (low + high) / 2;
+        if (replay_read_u64(player->index + mid * REPLAY_INDEX_ENTRY_SIZE) <= frame_index)
+            low = mid;
+        else
+            high = mid;
+    }
+    u8 *entry = player->index + low * REPLAY_INDEX_ENTRY_SIZE;
+    u64 keyframe      = replay_read_u64(entry);
+    u64 state_offset  = replay_read_u64(entry + 8);
+    u64 state_size    = replay_read_u64(entry + 16);
+    u64 event_offset  = replay_read_u64(entry + 24);
+    u64 event_base    = replay_read_u64(entry + 32);
+
+    u64 index_offset = player->index - player->data;
+    if (state_offset > index_offset || state_size > index_offset - state_offset || event_offset > index_offset)
+        return false;
+
+    // Keyframes are stored against the state the match started from
+    if (!replay_open(player, player->data, player->size, game))
+        return false;
+    if (!apply_state_delta(game, sizeof(GameState), player->data + state_offset, state_size) || game->frame_index != keyframe)
+        return false;
+
+    player->cursor = player->data + event_offset;
+    player->last_frame = event_base;
+    player->ended = false;
+    return replay_play_until(player, game, frame_index);
+}
+
+// Appends a keyframe every REPLAY_KEYFRAME_INTERVAL frames and their
+// index, taking the states from playing the events back
+void replay_write_index(ReplayRecorder *rec, u64 end_frame)
+{
+    static GameState game, start_state;
+
+    rec->events_size = replay_size(rec);
+    byte_queue_end_read(&rec->index, byte_queue_used_space(&rec->index));
+
+    ReplayPlayer player;
+    bool ok = replay_open(&player, replay_data(rec), rec->events_size, &game);
+    assert(ok, "Couldn't play back the replay being recorded");
+    memcpy(&start_state, &game, sizeof(GameState));
+
+    u32 num_keyframes = 0;
+    for (u64 frame = game.frame_index;; frame += REPLAY_KEYFRAME_INTERVAL) {
+        ok = replay_play_until(&player, &game, frame);
+        assert(ok, "Couldn't play back the replay being recorded");
+        u64 event_offset = player.cursor - replay_data(rec);
+
+        if (!byte_queue_ensure_min_free_space(&rec->data, MAX_STATE_DELTA_SIZE)) {
+            printf("OUT OF MEMORY\n");
+            abort();
+        }
+        u64 state_offset = replay_size(rec);
+        u32 state_size = encode_state_delta((u8*) byte_queue_start_write(&rec->data), &start_state, &game, sizeof(GameState));
+        byte_queue_end_write(&rec->data, state_size);
+
+        replay_write_u64(&rec->index, frame);
+        replay_write_u64(&rec->index, state_offset);
+        replay_write_u64(&rec->index, state_size);
+        replay_write_u64(&rec->index, event_offset);
+        replay_write_u64(&rec->index, player.last_frame);
+        num_keyframes++;
+
+        // Writing may have moved the data
+        player.cursor = replay_data(rec) + event_offset;
+        player.end = replay_data(rec) + rec->events_size;
+
+        if (frame + REPLAY_KEYFRAME_INTERVAL >= end_frame)
+            break;
+    }
+
+    u64 index_offset = replay_size(rec);
+    replay_write_bytes(&rec->data, byte_queue_start_read(&rec->index), byte_queue_used_space(&rec->index));
+    replay_write_u64(&rec->data, index_offset);
+    replay_write_u64(&rec->data, end_frame);
+    replay_write_u32(&rec->data, num_keyframes);
+    replay_write_u32(&rec->data, sizeof(GameState));
+    replay_write_bytes(&rec->data, "SNKI", 4);
+}
+
+void replay_record_end(ReplayRecorder *rec, GameState *game)
+{
+    if (!rec->active)
+        return;
+    replay_write_event(rec, game->frame_index, false, REPLAY_END_PLAYER, 0);
+    replay_write_u64(&rec->data, game->hash);
+    replay_write_index(rec, game->frame_index);
+}
+
+// Plays the rest of the match as fast as possible. Returns true if it
+// ended where and how it did when it was recorded.
+bool replay_run(ReplayPlayer *player, GameState *game)
+{
+    Input input;
+    while (replay_next_input(player, &input)) {
+        while (game->frame_index < input.time)
+            update_game_instance(game);
+        apply_input_to_game_instance(game, input);
+    }
+    if (!player->ended || game->frame_index > player->end_frame)
+        return false;
+
+    while (game->frame_index < player->end_frame)
+        update_game_instance(game);
+    return game->hash == player->end_hash;
+}
@@ -1,73 +1,239 @@
-#define INPUTS_MASK (MAX_INPUTS-1)
+// Bit per player
+typedef struct {
+    u64 words[(MAX_SNAKES + 63) / 64];
+} PlayerSet;
 
-Input inputs[MAX_INPUTS];
-int inputs_head;
-int inputs_count;
+void player_set_add(PlayerSet *set, u32 player)
+{
+    set->words[player / 64] |= (u64) 1 << (player % 64);
+}
+
+bool player_set_has(PlayerSet *set, u32 player)
+{
+    return (set->words[player / 64] >> (player % 64)) & 1;
+}
+
+// Lowest player in the set not below the given one, or -1
+int player_set_next(PlayerSet *set, u32 player)
+{
+    for (u32 w = player / 64; w < COUNTOF(set->words); w++) {
+        u64 bits = set->words[w];
+        if (w == player / 64)
+            bits &= (u64) -1 << (player % 64);
+        if (bits)
+            return w * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+#define FOR_EACH_PLAYER(player, set) \
+    for (int player = player_set_next(set, 0); player >= 0; player = player_set_next(set, player + 1))
+
+// Inputs are stored per frame in a table indexed by frame number
+// modulo INPUT_WINDOW. Each frame holds one slot per player with the
+// last direction pressed during that frame and the last different
+// one before it. change_snake_direction ignores a direction opposite
+// to the current one, so applying those two in order gives the same
+// result as applying every input of the frame in order.
+typedef struct {
+    u64 frame_index; // Frame the slot holds inputs for, or NO_FRAME
+    PlayerSet players;     // Players with an input in this frame
+    PlayerSet disconnects; // Players that disconnected in this frame
+    s8  dirs[MAX_SNAKES][2]; // Previous and last direction, 0 if none
+} InputFrame;
+
+_Static_assert(INPUT_WINDOW > MAX_ROLLBACK_FRAMES, "The input window must cover the rollback window");
+
+#define INPUT_WINDOW_MASK (INPUT_WINDOW-1)
+
+InputFrame input_frames[INPUT_WINDOW];
+
+// Inputs of remote players arrive late, so the frames they are still
+// missing for are simulated with a guess of what they pressed. The
+// guess is recorded as the direction the snake ended up heading to,
+// and checked against the real inputs once they are known: a player's
+// inputs arrive in order, so one for frame T means there's nothing
+// else coming for the frames before it. Only wrong guesses roll back.
+typedef struct {
+    u64 frame_index;
+    PlayerSet players; // Players with a guess in this frame
+    s8  next_dirs[MAX_SNAKES];
+
+    // Direction and next direction of the snakes before the guess,
+    // which is when the frame started as the player had no inputs yet
+    s8  start_dirs[MAX_SNAKES][2];
+} PredictionFrame;
+
+PredictionFrame prediction_frames[INPUT_WINDOW];
+
+// First frame each player may still send inputs for
+u64 next_unconfirmed_frame[MAX_SNAKES];
+
+// Returns the direction a player is guessed to press during the
+// current frame of the game, or 0 for none. Predictors may only read
+// the game.
+typedef Direction (*InputPredictor)(GameState *game, int player);
+
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 rollback_frames;    // Frames rolled back because of misses
+    u32 max_rollback_depth;
+} PredictionStats;
+
+PredictionStats prediction_stats[MAX_SNAKES];
+
+// How far back late inputs may land, tuned to the connection by
+// tune_rollback_to_latency. Snapshots always reach MAX_ROLLBACK_FRAMES
+// back and frames are only confirmed past that, the window decides
+// how long guesses stay open, so a short one means shallower rollbacks.
+// An input later than the window widens it.
+u32 rollback_window_frames = MAX_ROLLBACK_FRAMES;
+
+// A guess that is still unconfirmed this many frames later is taken
+// as wrong, so a player that stops sending inputs can't keep a guess
+// in the history past the rollback window.
+#define PREDICTION_TIMEOUT_FRAMES (rollback_window_frames * 3 / 4)
 
 int self_snake_index;
-GameState oldest_game_state;
 GameState latest_game_state;
 
+// snapshots[i % NUM_SNAPSHOTS] holds the state at the start of frame i,
+// before the inputs of that frame were applied. Snapshots go back
+// rollback_window_frames frames from the latest one, or to
+// first_snapshot_frame when the match is younger than that.
+//
+// With ROLLBACK_UNDO_LOG the states aren't copied. Instead the position
+// of the undo log at the start of each frame is kept, and rolling back
+// rewinds latest_game_state to it. The snapshots are left unused.
+#define NUM_SNAPSHOTS (MAX_ROLLBACK_FRAMES + 1)
+GameState snapshots[NUM_SNAPSHOTS];
+u64 first_snapshot_frame;
+
+#if ROLLBACK_UNDO_LOG
+u64 snapshot_undo_positions[NUM_SNAPSHOTS];
+u64 snapshot_hashes[NUM_SNAPSHOTS];
+#endif
+
+// Earliest frame that received an input after it was simulated, or
+// NO_FRAME if the latest state is up to date.
+u64 first_dirty_frame = NO_FRAME;
+
+typedef struct {
+    u64 frames_simulated;   // Frames advanced normally
+    u64 frames_resimulated; // Frames simulated again because of late inputs
+    u64 rollbacks;
+
+    // Counts over the last complete second
+    u32 frames_resimulated_per_second;
+    u32 rollbacks_per_second;
+
+    double window_start_time;
+    u64 window_start_frames_resimulated;
+    u64 window_start_rollbacks;
+} RollbackStats;
+
+RollbackStats rollback_stats;
+
+// How many frames late the last late input of each player arrived,
+// 0 if none did yet
+u32 input_lag_frames[MAX_SNAKES];
+
+// Hashes of confirmed frames, the ones older than the snapshots reach
+// which can't change anymore. Peers exchange them to detect desyncs.
+// Remote hashes may arrive before or after the local one, whichever
+// comes second does the comparison.
+typedef struct {
+    u64  frame_index;
+    u64  local_hash;
+    bool has_local;
+    PlayerSet has_remote;
+    u64  remote_hashes[MAX_SNAKES];
+} StateHashCheck;
+
+StateHashCheck hash_checks[INPUT_WINDOW];
+u64 last_confirmed_frame = NO_FRAME;
+
+// Recording of the current match. Inputs are added once their frame
+// is confirmed, as only then are they final.
+ReplayRecorder match_replay;
+u64 next_replay_frame; // First frame whose inputs aren't recorded yet
+
 u64 get_current_frame_index(void)
 {
     return latest_game_state.frame_index;
 }
 
-void input_queue_init(void)
+void input_table_init(void)
 {
-    inputs_head = 0;
-    inputs_count = 0;
+    for (int i = 0; i < INPUT_WINDOW; i++)
+        input_frames[i].frame_index = NO_FRAME;
 }
 
-void input_queue_free(void)
+u64 oldest_snapshot_frame(void)
 {
+    u64 latest = latest_game_state.frame_index;
+    if (latest - first_snapshot_frame < rollback_window_frames)
+        return first_snapshot_frame;
+    return latest - rollback_window_frames;
 }
 
-void input_queue_push(Input input)
+// Frames before this one are confirmed: an input for them would be
+// older than the snapshots reach, so the window can't widen to take
+// it, and their states and inputs are final.
+u64 confirmed_frame(void)
 {
-    if (inputs_count == MAX_INPUTS) {
-        printf("Input queue is full\n");
-        abort();
-    }
+    u64 latest = latest_game_state.frame_index;
+    if (latest - first_snapshot_frame < MAX_ROLLBACK_FRAMES)
+        return first_snapshot_frame;
+    return latest - MAX_ROLLBACK_FRAMES;
+}
 
-    if (input.time < oldest_game_state.frame_index) {
-        printf("Input is too old\n");
-        abort();
-    }
+// Returns the slot of the given frame, or NULL if the frame doesn't
+// have any inputs.
+InputFrame *get_input_frame(u64 frame_index)
+{
+    InputFrame *frame = &input_frames[frame_index & INPUT_WINDOW_MASK];
+    if (frame->frame_index != frame_index)
+        return NULL;
+    return frame;
+}
 
-    // Find the first entry that is older from the tail
-    // (Here by tail we mean the last element, not the
-    // first free slot).
-    uint64_t i = (uint64_t) inputs_count - 1;
-    while (i != (uint64_t) -1 && input.time < inputs[(inputs_head + i) & INPUTS_MASK].time) {
-        i--;
+// Returns false if the input is so far in the future that its slot
+// is still used by a frame that can be rolled back to.
+bool input_table_insert(Input input)
+{
+    InputFrame *frame = &input_frames[input.time & INPUT_WINDOW_MASK];
+    if (frame->frame_index != input.time) {
+        if (frame->frame_index != NO_FRAME && frame->frame_index >= confirmed_frame())
+            return false;
+        memset(frame, 0, sizeof(InputFrame));
+        frame->frame_index = input.time;
     }
-    i++;
-    // i here is the insert position
-
-    for (uint64_t j = inputs_count; j > i; j--)
-        inputs[(inputs_head + j) & INPUTS_MASK] = inputs[(inputs_head + j - 1) & INPUTS_MASK];
 
-    inputs[(inputs_head + i) & INPUTS_MASK] = input;
-    inputs_count++;
-}
+    player_set_add(&frame->players, input.player);
 
-bool input_queue_pop(Input *input)
-{
-    if (inputs_count == 0)
-        return false;
-    *input = inputs[inputs_head];
-    inputs_head = (inputs_head + 1) & INPUTS_MASK;
-    inputs_count--;
+    if (input.disconnect) {
+        player_set_add(&frame->disconnects, input.player);
+    } else {
+        s8 *dirs = frame->dirs[input.player];
+        if (dirs[1] != input.dir) {
+            dirs[0] = dirs[1];
+            dirs[1] = input.dir;
+        }
+    }
     return true;
 }
 
-bool input_queue_peek(u32 index, Input *input)
+// Returns whether apply_input_to_game can take the input. It can't
+// if it's older than the snapshots, or so far in the future that its
+// slot is still in use, so the peer that sent it has to be dropped.
+bool can_apply_input(Input input)
 {
-    if (inputs_count <= index)
+    if (input.time < confirmed_frame())
         return false;
-    *input = inputs[(inputs_head + index) & INPUTS_MASK];
-    return true;
+    InputFrame *frame = &input_frames[input.time & INPUT_WINDOW_MASK];
+    return frame->frame_index == input.time || frame->frame_index == NO_FRAME || frame->frame_index < confirmed_frame();
 }
 
 bool we_are_dead(void)
@@ -75,65 +241,441 @@ bool we_are_dead(void)
     return !latest_game_state.snakes[self_snake_index].used;
 }
 
-void apply_inputs_to_game_instance_until_time(GameState *game, uint64_t frame_index_limit, bool pop)
+void apply_inputs_of_frame(GameState *game, u64 frame_index)
+{
+    InputFrame *frame = get_input_frame(frame_index);
+    if (frame == NULL)
+        return;
+
+    FOR_EACH_PLAYER(player, &frame->players) {
+        for (int i = 0; i < 2; i++) {
+            Direction dir = frame->dirs[player][i];
+            if (dir != 0)
+                apply_input_to_game_instance(game, (Input) {.time=frame_index, .player=player, .dir=dir});
+        }
+        if (player_set_has(&frame->disconnects, player))
+            apply_input_to_game_instance(game, (Input) {.time=frame_index, .player=player, .disconnect=true});
+    }
+}
+
+// Keeps going the way the player last pressed. This is what the game
+// did before predictions existed.
+Direction predict_last_direction(GameState *game, int player)
 {
-    uint64_t last_frame_index = game->frame_index;
-    u32 cursor = 0;
+    return game->snakes[player].next_dir;
+}
 
-    for (;;) {
+// Like predict_last_direction, unless the cell ahead is taken by a
+// snake. Then the player is guessed to turn towards a free cell. The
+// world wraps around, so there are no walls to avoid.
+Direction predict_avoiding_snakes(GameState *game, int player)
+{
+    Snake *s = &game->snakes[player];
 
-        Input input;
-        bool done = !input_queue_peek(cursor, &input);
-        if (done || input.time > frame_index_limit) break;
+    Direction turn = (s->next_dir == DIR_UP || s->next_dir == DIR_DOWN) ? DIR_LEFT : DIR_UP;
+    Direction choices[] = {s->next_dir, turn, -turn};
 
-        if (pop)
-            input_queue_pop(&input);
-        else {
-            cursor++;
-        }
+    for (int i = 0; i < COUNTOF(choices); i++) {
+        u32 x = s->head_x, y = s->head_y;
+        step_in_direction(game, &x, &y, choices[i]);
+        if (cell_count(game, x, y) == 0)
+            return choices[i];
+    }
+    return s->next_dir;
+}
 
-        assert(last_frame_index <= input.time);
-        while (last_frame_index < input.time) {
-            update_game_instance(game);
-            last_frame_index++;
-        }
+InputPredictor input_predictor = predict_last_direction;
+
+// Applies the guesses for the players that may still send inputs for
+// the current frame of the game. Must come after the real inputs.
+void apply_predictions(GameState *game, u64 *next_unconfirmed, PredictionFrame *predicted)
+{
+    predicted->frame_index = game->frame_index;
+    predicted->players = (PlayerSet) {0};
 
-        apply_input_to_game_instance(game, input);
+    for (int player = 0; player < MAX_SNAKES; player++) {
+        Snake *s = &game->snakes[player];
+        if (player == self_snake_index || !s->used || game->frame_index < next_unconfirmed[player])
+            continue;
+
+        predicted->start_dirs[player][0] = s->dir;
+        predicted->start_dirs[player][1] = s->next_dir;
+
+        Direction dir = input_predictor(game, player);
+        if (dir != 0)
+            apply_input_to_game_instance(game, (Input) {.time=game->frame_index, .player=player, .dir=dir});
+
+        player_set_add(&predicted->players, player);
+        predicted->next_dirs[player] = s->next_dir;
     }
+}
+
+// Applies the inputs of the current frame of a state from the
+// rollback history, real or guessed
+void apply_frame_inputs(GameState *game)
+{
+    apply_inputs_of_frame(game, game->frame_index);
+    apply_predictions(game, next_unconfirmed_frame, &prediction_frames[game->frame_index & INPUT_WINDOW_MASK]);
+}
+
+#if ROLLBACK_UNDO_LOG
+// The scalar fields of the state aren't logged by game.c but once at
+// the start of every frame, see undo.c
+void log_scalar_fields(GameState *game)
+{
+    UNDO_BYTES(game, offsetof(GameState, snakes));
+    UNDO_BYTES(&game->num_free_cells, sizeof(GameState) - offsetof(GameState, num_free_cells));
+}
+#endif
+
+void save_snapshot(GameState *game)
+{
+#if ROLLBACK_UNDO_LOG
+    assert(game == &latest_game_state);
+    snapshot_undo_positions[game->frame_index % NUM_SNAPSHOTS] = undo_log_end;
+    snapshot_hashes[game->frame_index % NUM_SNAPSHOTS] = game->hash;
+    log_scalar_fields(game);
+#else
+    memcpy(&snapshots[game->frame_index % NUM_SNAPSHOTS], game, sizeof(GameState));
+#endif
+}
 
-    while (last_frame_index < frame_index_limit) {
-        update_game_instance(game);
-        last_frame_index++;
+// Sets latest_game_state back to the start of an earlier frame
+void restore_snapshot(u64 frame_index)
+{
+#if ROLLBACK_UNDO_LOG
+    undo_rewind(snapshot_undo_positions[frame_index % NUM_SNAPSHOTS]);
+    assert(latest_game_state.frame_index == frame_index);
+    log_scalar_fields(&latest_game_state);
+#else
+    memcpy(&latest_game_state, &snapshots[frame_index % NUM_SNAPSHOTS], sizeof(GameState));
+    assert(latest_game_state.frame_index == frame_index, "The snapshot of the frame was overwritten");
+#endif
+}
+
+u64 get_snapshot_hash(u64 frame_index)
+{
+#if ROLLBACK_UNDO_LOG
+    return snapshot_hashes[frame_index % NUM_SNAPSHOTS];
+#else
+    return snapshots[frame_index % NUM_SNAPSHOTS].hash;
+#endif
+}
+
+// Makes the current latest_game_state the first snapshot of the match.
+// Must be called whenever latest_game_state is set up from scratch.
+void init_rollback_history(void)
+{
+    first_snapshot_frame = latest_game_state.frame_index;
+    first_dirty_frame = NO_FRAME;
+    last_confirmed_frame = NO_FRAME;
+    memset(input_lag_frames, 0, sizeof(input_lag_frames));
+    for (int i = 0; i < MAX_SNAKES; i++)
+        next_unconfirmed_frame[i] = first_snapshot_frame;
+    for (int i = 0; i < INPUT_WINDOW; i++) {
+        hash_checks[i].frame_index = NO_FRAME;
+        prediction_frames[i].frame_index = NO_FRAME;
     }
+#if ROLLBACK_UNDO_LOG
+    undo_attach(&latest_game_state, sizeof(GameState));
+#endif
+    replay_record_start(&match_replay, &latest_game_state);
+    next_replay_frame = first_snapshot_frame;
+    save_snapshot(&latest_game_state);
+    apply_frame_inputs(&latest_game_state);
+}
+
+void advance_latest_state(void)
+{
+    update_game_instance(&latest_game_state);
+    save_snapshot(&latest_game_state);
+    apply_frame_inputs(&latest_game_state);
 }
 
 void recalculate_latest_state(void)
 {
-    u64 lookback = 32;
+    if (first_dirty_frame == NO_FRAME)
+        return;
+
+    // Restore the last state that didn't see the late inputs and
+    // simulate from there. Frames before it are left untouched.
     u64 latest_frame_index = latest_game_state.frame_index;
+    u64 frame_index = first_dirty_frame;
+    first_dirty_frame = NO_FRAME;
 
-    // Apply old inputs permanently
-    if (latest_frame_index >= lookback)
-        apply_inputs_to_game_instance_until_time(&oldest_game_state, latest_frame_index - lookback, true);
+    restore_snapshot(frame_index);
+    apply_frame_inputs(&latest_game_state);
+    while (latest_game_state.frame_index < latest_frame_index)
+        advance_latest_state();
 
-    // Apply newer inputs
-    memcpy(&latest_game_state, &oldest_game_state, sizeof(GameState));
-    apply_inputs_to_game_instance_until_time(&latest_game_state, latest_frame_index, false);
+    rollback_stats.frames_resimulated += latest_frame_index - frame_index;
+    rollback_stats.rollbacks++;
 }
 
-void apply_input_to_game(Input input)
+// Moves the latest state to the given frame, simulating forward or
+// restoring an older snapshot as needed.
+void jump_to_frame(u64 frame_index)
+{
+    // Advancing overwrites the oldest snapshots, which a pending
+    // rollback may still have to restore
+    if (frame_index > latest_game_state.frame_index)
+        recalculate_latest_state();
+
+    if (frame_index < latest_game_state.frame_index) {
+        frame_index = MAX(frame_index, oldest_snapshot_frame());
+        restore_snapshot(frame_index);
+        apply_frame_inputs(&latest_game_state);
+        if (first_dirty_frame != NO_FRAME && first_dirty_frame >= frame_index)
+            first_dirty_frame = NO_FRAME;
+    }
+
+    while (latest_game_state.frame_index < frame_index) {
+        advance_latest_state();
+        rollback_stats.frames_simulated++;
+    }
+}
+
+StateHashCheck *get_hash_check(u64 frame_index)
 {
+    StateHashCheck *check = &hash_checks[frame_index & INPUT_WINDOW_MASK];
+    if (check->frame_index != frame_index) {
+        // Don't let a late message evict a newer frame
+        if (check->frame_index != NO_FRAME && check->frame_index > frame_index)
+            return NULL;
+        memset(check, 0, sizeof(StateHashCheck));
+        check->frame_index = frame_index;
+    }
+    return check;
+}
+
+void compare_state_hashes(StateHashCheck *check)
+{
+    if (!check->has_local)
+        return;
+
+    FOR_EACH_PLAYER(player, &check->has_remote) {
+        if (check->remote_hashes[player] != check->local_hash)
+            printf("Desync with player %d at frame %d\n", player, (int) check->frame_index);
+    }
+    check->has_remote = (PlayerSet) {0};
+}
+
+void receive_state_hash(u32 player, u64 frame_index, u64 hash)
+{
+    if (player >= MAX_SNAKES)
+        return;
+
+    StateHashCheck *check = get_hash_check(frame_index);
+    if (check == NULL)
+        return;
+
+    check->remote_hashes[player] = hash;
+    player_set_add(&check->has_remote, player);
+    compare_state_hashes(check);
+}
+
+// Records the hash of the oldest snapshot once it's confirmed and
+// sends it to the other peers.
+void confirm_oldest_snapshot(void)
+{
+    u64 frame_index = confirmed_frame();
+    if (last_confirmed_frame != NO_FRAME && frame_index <= last_confirmed_frame)
+        return;
+    last_confirmed_frame = frame_index;
+
+    StateHashCheck *check = get_hash_check(frame_index);
+    check->local_hash = get_snapshot_hash(frame_index);
+    check->has_local = true;
+
+#if HAVE_MULTIPLAYER
     if (multiplayer)
-		input.time += INPUT_FRAME_DELAY_COUNT;
+        send_state_hash(frame_index, check->local_hash);
+#endif
+
+    compare_state_hashes(check);
+}
+
+// Adds the inputs of the frames before frame_index to the recording,
+// in the order apply_inputs_of_frame applies them
+void record_inputs_until(u64 frame_index)
+{
+    for (; next_replay_frame < frame_index; next_replay_frame++) {
+        InputFrame *frame = get_input_frame(next_replay_frame);
+        if (frame == NULL)
+            continue;
+
+        FOR_EACH_PLAYER(player, &frame->players) {
+            for (int i = 0; i < 2; i++) {
+                Direction dir = frame->dirs[player][i];
+                if (dir != 0)
+                    replay_record_input(&match_replay, (Input) {.time=next_replay_frame, .player=player, .dir=dir});
+            }
+            if (player_set_has(&frame->disconnects, player))
+                replay_record_input(&match_replay, (Input) {.time=next_replay_frame, .player=player, .disconnect=true});
+        }
+    }
+}
+
+// Finishes the recording of the match at the latest frame and writes
+// it to a file
+bool save_match_replay(char *path)
+{
+    if (!match_replay.active)
+        return false;
+    record_inputs_until(latest_game_state.frame_index);
+    replay_record_end(&match_replay, &latest_game_state);
+    string data = {.count=replay_size(&match_replay), .data=replay_data(&match_replay)};
+    return os_write_entire_file_s(STR(path), data);
+}
+
+void update_rollback_stats(void)
+{
+    RollbackStats *stats = &rollback_stats;
+
+    double current_time = os_get_current_time_in_seconds();
+    if (stats->window_start_time <= 0) {
+        stats->window_start_time = current_time;
+        return;
+    }
+
+    if (current_time - stats->window_start_time >= 1) {
+        double elapsed = current_time - stats->window_start_time;
+        stats->frames_resimulated_per_second = (stats->frames_resimulated - stats->window_start_frames_resimulated) / elapsed;
+        stats->rollbacks_per_second = (stats->rollbacks - stats->window_start_rollbacks) / elapsed;
+        stats->window_start_time = current_time;
+        stats->window_start_frames_resimulated = stats->frames_resimulated;
+        stats->window_start_rollbacks = stats->rollbacks;
+    }
+}
+
+// Checks the guesses for a player's inputs up to frame until_frame,
+// whose real inputs are all in the table now, and rolls back to the
+// first wrong one.
+void confirm_predictions(u32 player, u64 until_frame)
+{
+    u64 latest = latest_game_state.frame_index;
+    u64 frame_index = MAX(next_unconfirmed_frame[player], oldest_snapshot_frame());
 
-	if (input.time < oldest_game_state.frame_index) {
-    	printf("Input is too old\n");
-        abort();
+    next_unconfirmed_frame[player] = MAX(next_unconfirmed_frame[player], until_frame + 1);
+
+    for (; frame_index <= until_frame && frame_index <= latest; frame_index++) {
+
+        PredictionFrame *predicted = &prediction_frames[frame_index & INPUT_WINDOW_MASK];
+        InputFrame *frame = get_input_frame(frame_index);
+        bool has_input = frame && player_set_has(&frame->players, player);
+
+        if (predicted->frame_index != frame_index || !player_set_has(&predicted->players, player)) {
+            // Nothing was guessed, so the frame is only wrong if it
+            // had inputs
+            if (has_input && frame_index < latest) {
+                first_dirty_frame = MIN(first_dirty_frame, frame_index);
+                return;
+            }
+            continue;
+        }
+
+        // Guesses are compared by where they left the snake heading
+        bool hit;
+        if (has_input && player_set_has(&frame->disconnects, player))
+            hit = false;
+        else {
+            Snake s = {.dir=predicted->start_dirs[player][0], .next_dir=predicted->start_dirs[player][1]};
+            for (int i = 0; has_input && i < 2; i++)
+                if (frame->dirs[player][i] != 0)
+                    change_snake_direction(&s, frame->dirs[player][i]);
+            hit = s.next_dir == predicted->next_dirs[player];
+        }
+
+        PredictionStats *stats = &prediction_stats[player];
+        if (hit)
+            stats->hits++;
+        else {
+            u32 depth = latest - frame_index;
+            stats->misses++;
+            stats->rollback_frames += depth;
+            stats->max_rollback_depth = MAX(stats->max_rollback_depth, depth);
+            first_dirty_frame = MIN(first_dirty_frame, frame_index);
+            return; // Later frames are simulated again anyway
+        }
     }
-    input_queue_push(input);
+}
+
+// Takes the guesses that stayed unconfirmed for too long as wrong
+void expire_predictions(void)
+{
+    u64 latest = latest_game_state.frame_index;
+    if (latest < PREDICTION_TIMEOUT_FRAMES)
+        return;
+
+    for (int player = 0; player < MAX_SNAKES; player++)
+        if (player != self_snake_index && next_unconfirmed_frame[player] + PREDICTION_TIMEOUT_FRAMES <= latest)
+            confirm_predictions(player, latest - PREDICTION_TIMEOUT_FRAMES);
+}
 
-    if (input.time == latest_game_state.frame_index)
-        apply_input_to_game_instance(&latest_game_state, input);
+// Picks the input delay and rollback window for a connection with the
+// given round trip time and jitter
+void tune_rollback_to_latency(float64 rtt_us, float64 jitter_us)
+{
+    // Frames an input spends on the way to the other peers, with some
+    // margin for jitter. Inputs between clients go through the server,
+    // so they arrive about a round trip late.
+    float64 frame_us = 1e6 / FPS;
+    u32 one_way    = ceil((rtt_us / 2 + 2 * jitter_us) / frame_us);
+    u32 round_trip = ceil((rtt_us     + 4 * jitter_us) / frame_us);
+
+    // Rolling back hides up to ROLLBACK_LATENCY_FRAMES of latency,
+    // beyond that our inputs are delayed instead
+    u32 delay = one_way > ROLLBACK_LATENCY_FRAMES ? one_way - ROLLBACK_LATENCY_FRAMES : 0;
+    input_delay_frames = MIN(MAX(delay, INPUT_FRAME_DELAY_COUNT), MAX_INPUT_DELAY_FRAMES);
+
+    // The window must also fit the latest inputs actually seen
+    u32 window = round_trip;
+    for (int i = 0; i < MAX_SNAKES; i++)
+        window = MAX(window, input_lag_frames[i]);
+    window = MIN(MAX(window + 2, MIN_ROLLBACK_FRAMES), MAX_ROLLBACK_FRAMES);
+
+    // Grow right away, shrink a frame at a time
+    if (window > rollback_window_frames)
+        rollback_window_frames = window;
+    else if (window < rollback_window_frames)
+        rollback_window_frames--;
+}
+
+// Inputs from the network are checked with can_apply_input first
+void apply_input_to_game(Input input)
+{
+    assert(can_apply_input(input), "The input is out of the rollback window");
+
+	if (input.time < oldest_snapshot_frame()) {
+        // The window was tuned too short for this input. The snapshots
+        // still reach back MAX_ROLLBACK_FRAMES, and frames are only
+        // confirmed past that, so widen it.
+        u64 latest = latest_game_state.frame_index;
+        printf("Input is %d frames late, widening the rollback window\n", (int) (latest - input.time));
+        rollback_window_frames = latest - input.time;
+    }
+    input_table_insert(input);
+
+    u64 latest = latest_game_state.frame_index;
+    if (input.time < latest)
+        input_lag_frames[input.player] = latest - input.time;
+
+    // Whether a guess for this player is applied to the latest state
+    PredictionFrame *predicted = &prediction_frames[input.time & INPUT_WINDOW_MASK];
+    bool guessed = input.time == latest && predicted->frame_index == latest && player_set_has(&predicted->players, input.player);
+
+    if (input.time < next_unconfirmed_frame[input.player]) {
+        // Another input for a frame that was already checked, or one
+        // that arrived after its guess expired
+        if (input.time < latest || guessed)
+            first_dirty_frame = MIN(first_dirty_frame, input.time);
+        else if (input.time == latest)
+            apply_input_to_game_instance(&latest_game_state, input);
+    } else {
+        confirm_predictions(input.player, input.time);
+        if (input.time == latest && !guessed)
+            apply_input_to_game_instance(&latest_game_state, input);
+    }
 }
 
 double last_update_time = -1;
@@ -144,61 +686,61 @@ u64 game_start_time;
 
 void send_initial_state(void)
 {
-	game_start_time = steam_get_current_time_us();
+	game_start_time = net_get_time_us();
 
 	input_globals_init();
-	init_game_state(&latest_game_state);
+	init_game_state(&latest_game_state, true);
 	int num_players = 1 + count_client_handles();
 	for (int i = 0; i < num_players; i++)
 		spawn_snake(&latest_game_state);
-	memcpy(&oldest_game_state, &latest_game_state, sizeof(GameState));
 
+	// Predictions skip our own snake from the first frame on
 	self_snake_index = 0;
+	init_rollback_history();
+	rollback_window_frames = MAX_ROLLBACK_FRAMES;
+	input_delay_frames = INPUT_FRAME_DELAY_COUNT;
 
-	char current_location_string[STEAM_PING_LOCATION_STRING_SIZE];
+	char current_location_string[NET_LOCATION_STRING_SIZE];
 	{
-		memset(current_location_string, 0, STEAM_PING_LOCATION_STRING_SIZE);
-
-		SteamPingLocation location;
-		steam_get_local_ping_location(&location);
-		steam_ping_location_to_string(&location, current_location_string, sizeof(current_location_string));
+		memset(current_location_string, 0, NET_LOCATION_STRING_SIZE);
+		net_transport->get_location(net_transport, current_location_string, sizeof(current_location_string));
+		current_location_string[NET_LOCATION_STRING_SIZE-1] = '\0';
 	}
+	int location_size = strlen(current_location_string);
 
-	// Send player positions to clients
+	// Send player positions to clients, see the wire protocol in net.c
 	for (int i = 0, j = 0; i < MAX_CLIENTS; i++) {
 
-		if (client_data[i].handle == STEAM_HANDLE_INVALID) {
+		NetHandle handle = client_data[i].handle;
+		if (handle == NET_HANDLE_INVALID) {
 			continue;
 		} else {
 			j++;
 		}
 
-		u64 time = htonll(game_start_time);
-		net_write(client_data[i].handle, &time, sizeof(time));
-
-		u64 seed = htonll(latest_game_state.seed);
-		net_write(client_data[i].handle, &seed, sizeof(seed));
+		net_write_varint(handle, NET_PROTOCOL_VERSION);
+		net_write_varint(handle, game_start_time);
+		net_write_varint(handle, latest_game_state.seed);
 
 		// Send the player count
-		u32 buffer = htonl(num_players);
-		net_write(client_data[i].handle, &buffer, sizeof(buffer));
+		net_write_varint(handle, num_players);
 
 		// Send the index associated to this client
-		buffer = htonl(j); // <-- This is j and not i
-		net_write(client_data[i].handle, &buffer, sizeof(buffer));
+		net_write_varint(handle, j); // <-- This is j and not i
+
+		net_write_varint(handle, latest_game_state.world_w);
+		net_write_varint(handle, latest_game_state.world_h);
 
-		net_write(client_data[i].handle, current_location_string, STEAM_PING_LOCATION_STRING_SIZE);
+		net_write_varint(handle, location_size);
+		net_write(handle, current_location_string, location_size);
 
 		// Send the player information
 		for (int k = 0; k < MAX_SNAKES; k++) {
 			Snake *s = &latest_game_state.snakes[k];
 			if (!s->used) continue;
 
-			buffer = htonl(s->head_x);
-			net_write(client_data[i].handle, &buffer, sizeof(buffer));
-
-			buffer = htonl(s->head_y);
-			net_write(client_data[i].handle, &buffer, sizeof(buffer));
+			net_write_varint(handle, s->head_x);
+			net_write_varint(handle, s->head_y);
 
 			assert(s->body_len == 0); // We are assuming the starting size is 0. If that
 										// wasn't the case we would need to send the body
@@ -212,53 +754,50 @@ u64 ping_time_us;
 
 void start_client_game(InitialGameStateMessage *initial)
 {
-	game_start_time = steam_get_current_time_us();
+	game_start_time = net_get_time_us();
 
 	input_globals_init();
-	init_game_state(&latest_game_state);
+	init_game_state_sized(&latest_game_state, true, initial->world_w, initial->world_h);
 	for (int i = 0; i < initial->num_snakes; i++)
-		init_snake(&latest_game_state.snakes[i],
+		init_snake(&latest_game_state, &latest_game_state.snakes[i],
 				initial->snakes[i].head_x,
 				initial->snakes[i].head_y);
 	latest_game_state.seed = initial->seed;
-	memcpy(&oldest_game_state, &latest_game_state, sizeof(GameState));
+
+	// Predictions skip our own snake from the first frame on, including
+	// the frames jumped over below
+	self_snake_index = (int) initial->self_index;
+	init_rollback_history();
+	rollback_window_frames = MAX_ROLLBACK_FRAMES;
+	input_delay_frames = INPUT_FRAME_DELAY_COUNT;
 
 	{
-		SteamPingLocation remote_location;
-		steam_parse_ping_location(initial->location, &remote_location);
-		ping_time_us = steam_estimate_ping_us(&remote_location);
+		ping_time_us = net_transport->estimate_ping_us(net_transport, initial->location);
 		printf("ping time = %f ms\n", (double) ping_time_us / 1000);
 	}
 
 	u32 latency_frames = (double) ping_time_us * FPS / 1000000;
-	latest_game_state.frame_index = latency_frames;
+	jump_to_frame(latency_frames);
 	printf("latency_frames=%d\n", latency_frames);
-
-	self_snake_index = (int) initial->self_index;
 }
 
 void sync_frame_index(uint64_t frame_index)
 {
-	uint64_t time = steam_get_current_time_us() - game_start_time;
+	uint64_t time = net_get_time_us() - game_start_time;
 
 	//printf("Sending sync time=%llu, frame=%llu\n", time, frame_index);
 
-	time = htonll(time);
-	frame_index = htonll(frame_index);
-
-	uint8_t type = MESSAGE_SYNC;
-    for (u32 i = 0; i < MAX_CLIENTS; i++) {
-        if (client_data[i].handle != STEAM_HANDLE_INVALID) {
-			net_write(client_data[i].handle, &type,        sizeof(type));
-            net_write(client_data[i].handle, &frame_index, sizeof(frame_index));
-			net_write(client_data[i].handle, &time,        sizeof(time));
-        }
-    }
+	ProtocolMessage msg = {.type=MESSAGE_SYNC, .frame_index=frame_index, .time_us=time};
+    for (u32 i = 0; i < MAX_CLIENTS; i++)
+        if (client_data[i].handle != NET_HANDLE_INVALID)
+			client_write_message(&client_data[i], &msg);
 }
 #endif /* HAVE_MULTIPLAYER */
 
 #define CONVERGE_INSTANTLY 1
 
+double last_ping_time = -1;
+
 u64   last_target_frame_index = -1;
 double last_target_update_time = -1;
 
@@ -280,11 +819,20 @@ void update_game(SyncMessage sync)
 		last_target_update_time = -1;
 		last_update_time = -1;
 		last_sync_time = -1;
+		last_ping_time = -1;
 	}
 
 #if HAVE_MULTIPLAYER
     if (multiplayer) {
 
+		if (last_ping_time < 0 || current_time - last_ping_time > PING_INTERVAL) {
+			RttEstimate rtt;
+			if (get_connection_rtt(&rtt))
+				tune_rollback_to_latency(rtt.srtt_us, rtt.jitter_us);
+			send_pings();
+			last_ping_time = current_time;
+		}
+
 		if (is_server) {
 
 			if (last_sync_time < 0 || current_time - last_sync_time > 1) {
@@ -296,7 +844,7 @@ void update_game(SyncMessage sync)
 
 			if (!sync.empty) {
 #if CONVERGE_INSTANTLY
-				latest_game_state.frame_index = sync.frame_index;
+				jump_to_frame(sync.frame_index);
 #endif
 				last_target_frame_index = sync.frame_index;
 				last_target_update_time = current_time + (double) ping_time_us / 1000000;
@@ -305,7 +853,9 @@ void update_game(SyncMessage sync)
 	}
 #endif
 
+	expire_predictions();
 	recalculate_latest_state();
+	update_rollback_stats();
 
 	u64 target_frame_index = get_target_frame_index();
 
@@ -345,10 +895,15 @@ void update_game(SyncMessage sync)
 	}
 
     if (num_steps > 0) {
-        for (int i = 0; i < num_steps; i++)
-            update_game_instance(&latest_game_state);
+        for (int i = 0; i < num_steps; i++) {
+            advance_latest_state();
+            rollback_stats.frames_simulated++;
+        }
         last_update_time = current_time;
     }
+
+    confirm_oldest_snapshot();
+    record_inputs_until(confirmed_frame());
 }
 
 bool game_apple_consumed_this_frame(void)
@@ -361,10 +916,12 @@ bool game_complete(void)
     return latest_game_state.game_complete;
 }
 
+#ifndef OOGABOOGA_HEADLESS
 void draw_game(void)
 {
     draw_game_instance(&latest_game_state);
 }
+#endif
 
 typedef enum {
 	GAME_RESULT_NONE,
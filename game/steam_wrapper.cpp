@@ -115,10 +115,13 @@ extern "C" void steam_free(void)
 	SteamAPI_Shutdown();
 }
 
+static void destroy_poll_group(void);
+
 extern "C" void steam_reset(void)
 {
 	steam_listen_stop();
 	steam_connect_stop();
+	destroy_poll_group();
 }
 
 static bool steam_networking_initialized(void)
@@ -378,28 +381,89 @@ extern "C" bool steam_send(uint32_t conn, void *buf, int len)
 	return SteamNetworkingSockets()->SendMessageToConnection(conn, buf, len, flags, NULL) == k_EResultOK;
 }
 
-extern "C" void *steam_recv(uint32_t conn, int *len)
+// May be lost or arrive out of order, but isn't held back by the
+// reliable messages sent before it
+extern "C" bool steam_send_unreliable(uint32_t conn, void *buf, int len)
+{
+	if (conn == STEAM_HANDLE_SERVER)
+		conn = connect_socket;
+
+	int flags
+		= k_nSteamNetworkingSend_Unreliable
+		| k_nSteamNetworkingSend_NoNagle;
+
+	return SteamNetworkingSockets()->SendMessageToConnection(conn, buf, len, flags, NULL) == k_EResultOK;
+}
+
+#define MAX_RECEIVE 64
+
+// Messages stay owned by Steam until steam_release, so callers read
+// them where they are
+extern "C" int steam_receive(uint32_t conn, SteamMessage *msgs, int max)
 {
 	if (conn == STEAM_HANDLE_SERVER)
 		conn = connect_socket;
 
-	SteamNetworkingMessage_t *message;
-	int num_messages = SteamNetworkingSockets()->ReceiveMessagesOnConnection(conn, &message, 1);
-	if (num_messages < 1) {
-		*len = 0;
-		return NULL;
+	SteamNetworkingMessage_t *messages[MAX_RECEIVE];
+	if (max > MAX_RECEIVE)
+		max = MAX_RECEIVE;
+
+	int num_messages = SteamNetworkingSockets()->ReceiveMessagesOnConnection(conn, messages, max);
+	for (int i = 0; i < num_messages; i++) {
+		msgs[i].data = messages[i]->m_pData;
+		msgs[i].size = messages[i]->m_cbSize;
+		msgs[i].internal = messages[i];
+		msgs[i].user_data = 0;
 	}
+	return num_messages;
+}
 
-	*len = message->m_cbSize;
-	return message->m_pData;
+extern "C" void steam_release(SteamMessage *msgs, int count)
+{
+	for (int i = 0; i < count; i++)
+		((SteamNetworkingMessage_t*) msgs[i].internal)->Release();
 }
 
-extern "C" void steam_consume(uint32_t conn)
+// Accepted connections go in a single poll group, so the server
+// receives the messages of all its clients with one call
+static HSteamNetPollGroup poll_group = k_HSteamNetPollGroup_Invalid;
+
+static void destroy_poll_group(void)
 {
-	SteamNetworkingMessage_t *message;
-	int num_messages = SteamNetworkingSockets()->ReceiveMessagesOnConnection(conn, &message, 1);
-	if (num_messages > 0)
-		message->Release();
+	if (poll_group != k_HSteamNetPollGroup_Invalid) {
+		SteamNetworkingSockets()->DestroyPollGroup(poll_group);
+		poll_group = k_HSteamNetPollGroup_Invalid;
+	}
+}
+
+extern "C" bool steam_join_poll_group(uint32_t conn, int64_t user_data)
+{
+	if (poll_group == k_HSteamNetPollGroup_Invalid) {
+		poll_group = SteamNetworkingSockets()->CreatePollGroup();
+		if (poll_group == k_HSteamNetPollGroup_Invalid)
+			return false;
+	}
+	return SteamNetworkingSockets()->SetConnectionUserData(conn, user_data)
+		&& SteamNetworkingSockets()->SetConnectionPollGroup(conn, poll_group);
+}
+
+extern "C" int steam_receive_on_poll_group(SteamMessage *msgs, int max)
+{
+	if (poll_group == k_HSteamNetPollGroup_Invalid)
+		return 0;
+
+	SteamNetworkingMessage_t *messages[MAX_RECEIVE];
+	if (max > MAX_RECEIVE)
+		max = MAX_RECEIVE;
+
+	int num_messages = SteamNetworkingSockets()->ReceiveMessagesOnPollGroup(poll_group, messages, max);
+	for (int i = 0; i < num_messages; i++) {
+		msgs[i].data = messages[i]->m_pData;
+		msgs[i].size = messages[i]->m_cbSize;
+		msgs[i].internal = messages[i];
+		msgs[i].user_data = messages[i]->m_nConnUserData;
+	}
+	return num_messages;
 }
 
 // 0=not created, 1=created, -1=failed
@@ -25,9 +25,19 @@ bool        steam_connect_start(SteamUserID peer_id);
 void        steam_connect_stop(void);
 int         steam_connect_status(void);
 
+typedef struct {
+    void *data;
+    int   size;
+    void *internal;
+    int64_t user_data; // Of the connection, for messages from the poll group
+} SteamMessage;
+
 bool        steam_send(SteamHandle conn, void *buf, int len);
-void*       steam_recv(SteamHandle conn, int *len);
-void        steam_consume(SteamHandle conn);
+bool        steam_send_unreliable(SteamHandle conn, void *buf, int len);
+int         steam_receive(SteamHandle conn, SteamMessage *msgs, int max); // -1 if the handle is invalid
+void        steam_release(SteamMessage *msgs, int count);
+bool        steam_join_poll_group(SteamHandle conn, int64_t user_data);
+int         steam_receive_on_poll_group(SteamMessage *msgs, int max);
 
 void        steam_create_lobby_start(int num_players);
 int         steam_create_lobby_result(void);
@@ -0,0 +1,1276 @@
+/*
+ * Transports carry the bytes of net.c between peers. Each one is a
+ * table of functions over connections named by handles:
+ *
+ *   steam     Steam networking sockets, through steam_wrapper.cpp
+ *   loopback  Endpoints in the same process, for tests and benchmarks
+ *   udp       Plain UDP sockets, for LAN games and dedicated servers
+ *
+ * Whatever the transport, messages sent over a connection arrive whole,
+ * once and in order. Unreliable ones, of at most NET_MAX_UNRELIABLE_SIZE
+ * bytes, arrive whole or not at all, in any order and without waiting
+ * for the reliable ones sent before them. A client names its connection
+ * to the server NET_HANDLE_SERVER, a server names its clients by the
+ * handles accept_connection returns.
+ *
+ * Received messages are handed out as views of the transport's own
+ * buffers, which stay valid until they are released.
+ *
+ * A server puts the connections it accepts in its poll group, each
+ * with a user data value. From then on their messages are received
+ * from the group, all connections at once and in the order they
+ * arrived, and each message carries the user data of its connection.
+ */
+
+#if HAVE_MULTIPLAYER
+
+typedef u32 NetHandle;
+#define NET_HANDLE_INVALID ((NetHandle) -1)
+#define NET_HANDLE_SERVER  ((NetHandle) -2)
+
+// Size of the string peers send each other to estimate their ping
+// before measuring it
+#define NET_LOCATION_STRING_SIZE 1024
+
+// Largest unreliable message, small enough for a datagram
+#define NET_MAX_UNRELIABLE_SIZE 1200
+
+enum {
+    CONNECT_OK = 0,
+    CONNECT_FAILED = -1,
+    CONNECT_PENDING = 1,
+};
+
+typedef struct {
+    u8   *data;
+    int   size;
+    void *internal; // The transport's own record of the message
+    s64   user_data; // Of the connection, for messages from the poll group
+} NetMessage;
+
+typedef struct Transport Transport;
+
+struct Transport {
+    char *name;
+
+    void      (*free)(Transport *t);
+    void      (*reset)(Transport *t);  // Stops listening and connecting
+    void      (*update)(Transport *t); // Once per frame, after sending and receiving
+
+    bool      (*listen_start)(Transport *t);
+    void      (*listen_stop)(Transport *t);
+    NetHandle (*accept_connection)(Transport *t); // NET_HANDLE_INVALID if nobody connected
+    void      (*close_accepted_connection)(Transport *t, NetHandle handle);
+    NetHandle (*get_disconnect_message)(Transport *t);
+
+    bool      (*connect_start)(Transport *t, u64 peer_id);
+    void      (*connect_stop)(Transport *t);
+    int       (*connect_status)(Transport *t);
+
+    bool      (*send)(Transport *t, NetHandle conn, void *buf, int len);
+    bool      (*send_unreliable)(Transport *t, NetHandle conn, void *buf, int len);
+    int       (*receive)(Transport *t, NetHandle conn, NetMessage *msgs, int max); // Up to max messages, -1 on error
+    void      (*release)(Transport *t, NetMessage *msgs, int count);
+
+    bool      (*join_poll_group)(Transport *t, NetHandle conn, s64 user_data); // Also changes the user data of a member
+    int       (*receive_on_poll_group)(Transport *t, NetMessage *msgs, int max);
+
+    void      (*get_location)(Transport *t, char *dst, int max);
+    u64       (*estimate_ping_us)(Transport *t, char *location);
+};
+
+// Clock for pings and sync messages. Only differences between its
+// values on the same peer are meaningful.
+u64 net_get_time_us(void)
+{
+    return (u64) (os_get_current_time_in_seconds() * 1000000);
+}
+
+// Transports with no idea where their peers are estimate every ping
+// as 0 and leave it to the measured round trip times
+void transport_no_location(Transport *t, char *dst, int max)
+{
+    if (max > 0) dst[0] = '\0';
+}
+
+u64 transport_no_ping_estimate(Transport *t, char *location)
+{
+    return 0;
+}
+
+/*
+ * Inboxes of the loopback and UDP transports. Every message gets a
+ * block of its own, so the views handed out don't move when more
+ * messages arrive. Released blocks go back to a pool shared by all the
+ * endpoints of the process, which makes receiving allocation free once
+ * the pool has warmed up.
+ */
+
+#define TRANSPORT_MESSAGE_MIN_CAPACITY 256
+
+typedef struct TransportMessage TransportMessage;
+
+struct TransportMessage {
+    TransportMessage *next;
+    NetHandle conn;
+    s64 user_data;
+    u64 arrival;      // Tick of loopback_time it arrives at, on simulated links
+    u32 size;
+    u32 capacity;
+    u8  data[];
+};
+
+typedef struct {
+    TransportMessage *head;
+    TransportMessage *tail;
+} MessageQueue;
+
+TransportMessage *transport_message_pool = NULL;
+
+TransportMessage *transport_message_alloc(u32 size)
+{
+    TransportMessage *msg = transport_message_pool;
+    if (msg && msg->capacity >= size)
+        transport_message_pool = msg->next;
+    else {
+        u32 capacity = MAX(size, TRANSPORT_MESSAGE_MIN_CAPACITY);
+        msg = alloc(get_heap_allocator(), sizeof(TransportMessage) + capacity);
+        if (!msg) return NULL;
+        msg->capacity = capacity;
+    }
+    msg->next = NULL;
+    msg->size = size;
+    return msg;
+}
+
+void transport_message_free(TransportMessage *msg)
+{
+    msg->next = transport_message_pool;
+    transport_message_pool = msg;
+}
+
+void message_queue_append(MessageQueue *queue, TransportMessage *msg)
+{
+    msg->next = NULL;
+    if (queue->tail)
+        queue->tail->next = msg;
+    else
+        queue->head = msg;
+    queue->tail = msg;
+}
+
+TransportMessage *message_queue_pop(MessageQueue *queue)
+{
+    TransportMessage *msg = queue->head;
+    if (msg) {
+        queue->head = msg->next;
+        if (!queue->head)
+            queue->tail = NULL;
+    }
+    return msg;
+}
+
+TransportMessage *message_queue_push(MessageQueue *queue, NetHandle conn, s64 user_data, void *data, int len)
+{
+    TransportMessage *msg = transport_message_alloc(len);
+    if (!msg) return NULL;
+    msg->conn = conn;
+    msg->user_data = user_data;
+    msg->arrival = 0;
+    memcpy(msg->data, data, len);
+    message_queue_append(queue, msg);
+    return msg;
+}
+
+// Takes up to max messages off the queue, they belong to the caller
+// until it releases them
+int message_queue_receive(MessageQueue *queue, NetMessage *msgs, int max)
+{
+    int n = 0;
+    while (n < max && queue->head) {
+        TransportMessage *msg = queue->head;
+        queue->head = msg->next;
+        msgs[n++] = (NetMessage) {.data=msg->data, .size=msg->size, .internal=msg, .user_data=msg->user_data};
+    }
+    if (!queue->head)
+        queue->tail = NULL;
+    return n;
+}
+
+void message_queue_clear(MessageQueue *queue)
+{
+    while (queue->head) {
+        TransportMessage *msg = queue->head;
+        queue->head = msg->next;
+        transport_message_free(msg);
+    }
+    queue->tail = NULL;
+}
+
+// Appends the messages of src to dst, for a connection joining the
+// poll group with messages still in its inbox
+void message_queue_move(MessageQueue *dst, MessageQueue *src)
+{
+    if (!src->head) return;
+    if (dst->tail)
+        dst->tail->next = src->head;
+    else
+        dst->head = src->head;
+    dst->tail = src->tail;
+    *src = (MessageQueue) {0};
+}
+
+void message_queue_set_user_data(MessageQueue *queue, NetHandle conn, s64 user_data)
+{
+    for (TransportMessage *msg = queue->head; msg; msg = msg->next)
+        if (msg->conn == conn)
+            msg->user_data = user_data;
+}
+
+// Drops the messages of a connection that closed from the poll group
+void message_queue_remove(MessageQueue *queue, NetHandle conn)
+{
+    TransportMessage **prev = &queue->head;
+    queue->tail = NULL;
+    while (*prev) {
+        TransportMessage *msg = *prev;
+        if (msg->conn == conn) {
+            *prev = msg->next;
+            transport_message_free(msg);
+        } else {
+            queue->tail = msg;
+            prev = &msg->next;
+        }
+    }
+}
+
+void transport_release_messages(Transport *t, NetMessage *msgs, int count)
+{
+    for (int i = 0; i < count; i++)
+        transport_message_free(msgs[i].internal);
+}
+
+#if HAVE_STEAM
+
+/*
+ * Steam transport, a thin layer over steam_wrapper.cpp
+ */
+
+#define STEAM_APP_ID 480
+
+void steam_transport_free(Transport *t)                                   { steam_free(); }
+void steam_transport_reset(Transport *t)                                  { steam_reset(); }
+void steam_transport_update(Transport *t)                                 { steam_update(); }
+bool steam_transport_listen_start(Transport *t)                           { return steam_listen_start(); }
+void steam_transport_listen_stop(Transport *t)                            { steam_listen_stop(); }
+NetHandle steam_transport_accept_connection(Transport *t)                 { return steam_accept_connection(); }
+void steam_transport_close_accepted_connection(Transport *t, NetHandle h) { steam_close_accepted_connection(h); }
+NetHandle steam_transport_get_disconnect_message(Transport *t)            { return steam_get_disconnect_message(); }
+bool steam_transport_connect_start(Transport *t, u64 peer_id)             { return steam_connect_start(peer_id); }
+void steam_transport_connect_stop(Transport *t)                           { steam_connect_stop(); }
+int  steam_transport_connect_status(Transport *t)                         { return steam_connect_status(); }
+bool steam_transport_send(Transport *t, NetHandle conn, void *buf, int len) { return steam_send(conn, buf, len); }
+bool steam_transport_send_unreliable(Transport *t, NetHandle conn, void *buf, int len) { return steam_send_unreliable(conn, buf, len); }
+
+_Static_assert(NET_LOCATION_STRING_SIZE == STEAM_PING_LOCATION_STRING_SIZE, "Ping locations don't fit the location string");
+_Static_assert(NET_HANDLE_SERVER == STEAM_HANDLE_SERVER && NET_HANDLE_INVALID == STEAM_HANDLE_INVALID, "Handles differ from Steam's");
+
+void steam_transport_get_location(Transport *t, char *dst, int max)
+{
+    SteamPingLocation location;
+    steam_get_local_ping_location(&location);
+    steam_ping_location_to_string(&location, dst, max);
+}
+
+int steam_transport_receive(Transport *t, NetHandle conn, NetMessage *msgs, int max)
+{
+    SteamMessage received[64];
+    int n = steam_receive(conn, received, MIN(max, COUNTOF(received)));
+    for (int i = 0; i < n; i++)
+        msgs[i] = (NetMessage) {.data=received[i].data, .size=received[i].size, .internal=received[i].internal};
+    return n;
+}
+
+void steam_transport_release(Transport *t, NetMessage *msgs, int count)
+{
+    for (int i = 0; i < count; i++) {
+        SteamMessage msg = {.data=msgs[i].data, .size=msgs[i].size, .internal=msgs[i].internal};
+        steam_release(&msg, 1);
+    }
+}
+
+bool steam_transport_join_poll_group(Transport *t, NetHandle conn, s64 user_data)
+{
+    return steam_join_poll_group(conn, user_data);
+}
+
+int steam_transport_receive_on_poll_group(Transport *t, NetMessage *msgs, int max)
+{
+    SteamMessage received[64];
+    int n = steam_receive_on_poll_group(received, MIN(max, COUNTOF(received)));
+    for (int i = 0; i < n; i++)
+        msgs[i] = (NetMessage) {.data=received[i].data, .size=received[i].size, .internal=received[i].internal, .user_data=received[i].user_data};
+    return n;
+}
+
+u64 steam_transport_estimate_ping_us(Transport *t, char *location)
+{
+    SteamPingLocation remote_location;
+    steam_parse_ping_location(location, &remote_location);
+    return steam_estimate_ping_us(&remote_location);
+}
+
+// Also initializes the Steam API, which the lobbies need too
+bool steam_transport_init(Transport *t)
+{
+    *t = (Transport) {
+        .name = "steam",
+        .free = steam_transport_free,
+        .reset = steam_transport_reset,
+        .update = steam_transport_update,
+        .listen_start = steam_transport_listen_start,
+        .listen_stop = steam_transport_listen_stop,
+        .accept_connection = steam_transport_accept_connection,
+        .close_accepted_connection = steam_transport_close_accepted_connection,
+        .get_disconnect_message = steam_transport_get_disconnect_message,
+        .connect_start = steam_transport_connect_start,
+        .connect_stop = steam_transport_connect_stop,
+        .connect_status = steam_transport_connect_status,
+        .send = steam_transport_send,
+        .send_unreliable = steam_transport_send_unreliable,
+        .receive = steam_transport_receive,
+        .release = steam_transport_release,
+        .join_poll_group = steam_transport_join_poll_group,
+        .receive_on_poll_group = steam_transport_receive_on_poll_group,
+        .get_location = steam_transport_get_location,
+        .estimate_ping_us = steam_transport_estimate_ping_us,
+    };
+    return steam_init(STEAM_APP_ID);
+}
+
+#endif /* HAVE_STEAM */
+
+/*
+ * Loopback transport. Endpoints live in the same process and find each
+ * other by address, peer_id in connect_start. A message is copied
+ * straight into the inbox of the connection at the other end, so it
+ * can be received before either endpoint updates.
+ *
+ * For tests of bad networks, the link of an endpoint can instead delay
+ * and lose the messages it sends. Its times are ticks of loopback_time, which
+ * whoever drives the endpoints advances, and messages on their way
+ * wait at the other end until an update of its endpoint finds them
+ * arrived. A lost reliable message arrives resend_interval ticks
+ * later, and the reliable messages sent after it wait for it.
+ */
+
+#define LOOPBACK_MAX_CONNECTIONS MAX_SNAKES
+
+typedef struct LoopbackTransport LoopbackTransport;
+
+typedef struct {
+    float64 loss;         // Chance that a message is lost, below 1
+    u32 latency;          // Ticks a message takes to arrive
+    u32 resend_interval;  // Ticks until a lost reliable message is sent again
+} LoopbackLink;
+
+u64 loopback_time = 0;
+
+typedef struct {
+    LoopbackTransport *peer; // NULL if the slot is free
+    NetHandle peer_handle;   // How the peer names this connection
+    bool accepted;
+    bool closed;             // By the peer, what's in the inbox can still be received
+    bool polled;             // Its messages go to the poll group instead of the inbox
+    s64 user_data;
+    MessageQueue inbox;
+    MessageQueue reliable_in_flight;   // Messages on their way over a simulated link,
+    MessageQueue unreliable_in_flight; // each queue in order of arrival
+} LoopbackConnection;
+
+struct LoopbackTransport {
+    Transport base;
+    u64 address;
+    bool listening;
+    int connect_status;
+    LoopbackConnection server; // NET_HANDLE_SERVER
+    LoopbackConnection clients[LOOPBACK_MAX_CONNECTIONS];
+    NetHandle disconnected[LOOPBACK_MAX_CONNECTIONS];
+    int num_disconnected;
+    MessageQueue poll_group;
+    LoopbackLink link;       // Of the messages this endpoint sends
+    u64 random;
+    LoopbackTransport *next;
+};
+
+LoopbackTransport *loopback_endpoints = NULL;
+
+LoopbackConnection *loopback_connection(LoopbackTransport *t, NetHandle handle)
+{
+    if (handle == NET_HANDLE_SERVER)
+        return &t->server;
+    if (handle < LOOPBACK_MAX_CONNECTIONS)
+        return &t->clients[handle];
+    return NULL;
+}
+
+void loopback_clear_connection(LoopbackConnection *conn)
+{
+    message_queue_clear(&conn->inbox);
+    message_queue_clear(&conn->reliable_in_flight);
+    message_queue_clear(&conn->unreliable_in_flight);
+    *conn = (LoopbackConnection) {0};
+}
+
+// Frees our end of the connection. The peer sees its end closed, and
+// a server reports it as a disconnect once it has accepted it.
+void loopback_close(LoopbackTransport *t, NetHandle handle)
+{
+    LoopbackConnection *conn = loopback_connection(t, handle);
+    if (!conn || !conn->peer) return;
+
+    LoopbackTransport *peer = conn->peer;
+    LoopbackConnection *other = loopback_connection(peer, conn->peer_handle);
+    if (other->peer == t && !other->closed) {
+        if (conn->peer_handle == NET_HANDLE_SERVER) {
+            other->closed = true;
+            peer->connect_status = CONNECT_FAILED;
+        } else if (other->accepted) {
+            other->closed = true;
+            if (peer->num_disconnected < LOOPBACK_MAX_CONNECTIONS)
+                peer->disconnected[peer->num_disconnected++] = conn->peer_handle;
+        } else
+            loopback_clear_connection(other);
+    }
+
+    if (conn->polled)
+        message_queue_remove(&t->poll_group, handle);
+    loopback_clear_connection(conn);
+}
+
+void loopback_listen_stop(Transport *base)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    for (NetHandle i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++)
+        if (t->clients[i].peer && !t->clients[i].accepted)
+            loopback_close(t, i);
+    t->listening = false;
+}
+
+bool loopback_listen_start(Transport *base)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    if (t->listening || t->server.peer)
+        return false;
+    t->listening = true;
+    return true;
+}
+
+NetHandle loopback_accept_connection(Transport *base)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    for (NetHandle i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++) {
+        LoopbackConnection *conn = &t->clients[i];
+        if (conn->peer && !conn->accepted && !conn->closed) {
+            conn->accepted = true;
+            conn->peer->connect_status = CONNECT_OK;
+            return i;
+        }
+    }
+    return NET_HANDLE_INVALID;
+}
+
+void loopback_close_accepted_connection(Transport *base, NetHandle handle)
+{
+    loopback_close((LoopbackTransport*) base, handle);
+}
+
+NetHandle loopback_get_disconnect_message(Transport *base)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    if (t->num_disconnected == 0)
+        return NET_HANDLE_INVALID;
+    return t->disconnected[--t->num_disconnected];
+}
+
+bool loopback_connect_start(Transport *base, u64 peer_id)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    if (t->listening || t->server.peer)
+        return false;
+
+    for (LoopbackTransport *server = loopback_endpoints; server; server = server->next) {
+        if (server == t || !server->listening || server->address != peer_id)
+            continue;
+        for (NetHandle i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++) {
+            if (server->clients[i].peer) continue;
+            server->clients[i] = (LoopbackConnection) {.peer=t, .peer_handle=NET_HANDLE_SERVER};
+            t->server = (LoopbackConnection) {.peer=server, .peer_handle=i};
+            t->connect_status = CONNECT_PENDING;
+            return true;
+        }
+        return false; // Server full
+    }
+    return false;
+}
+
+void loopback_connect_stop(Transport *base)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    loopback_close(t, NET_HANDLE_SERVER);
+    t->connect_status = CONNECT_FAILED;
+}
+
+int loopback_connect_status(Transport *base)
+{
+    return ((LoopbackTransport*) base)->connect_status;
+}
+
+void loopback_reset(Transport *base)
+{
+    loopback_listen_stop(base);
+    loopback_connect_stop(base);
+}
+
+// Moves the messages that arrived by now to where they're received
+void loopback_deliver(LoopbackTransport *t, LoopbackConnection *conn)
+{
+    MessageQueue *in_flight[] = {&conn->reliable_in_flight, &conn->unreliable_in_flight};
+    MessageQueue *queue = conn->polled ? &t->poll_group : &conn->inbox;
+    for (int i = 0; i < COUNTOF(in_flight); i++) {
+        while (in_flight[i]->head && in_flight[i]->head->arrival <= loopback_time) {
+            TransportMessage *msg = message_queue_pop(in_flight[i]);
+            msg->user_data = conn->user_data;
+            message_queue_append(queue, msg);
+        }
+    }
+}
+
+void loopback_update(Transport *base)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    if (t->server.peer)
+        loopback_deliver(t, &t->server);
+    for (NetHandle i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++)
+        if (t->clients[i].peer)
+            loopback_deliver(t, &t->clients[i]);
+}
+
+// Whether no message is on its way over a simulated link
+bool loopback_links_idle(void)
+{
+    for (LoopbackTransport *t = loopback_endpoints; t; t = t->next) {
+        if (t->server.reliable_in_flight.head || t->server.unreliable_in_flight.head)
+            return false;
+        for (NetHandle i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++)
+            if (t->clients[i].reliable_in_flight.head || t->clients[i].unreliable_in_flight.head)
+                return false;
+    }
+    return true;
+}
+
+bool loopback_link_simulated(LoopbackTransport *t)
+{
+    return t->link.loss > 0 || t->link.latency > 0;
+}
+
+// Uniform in [0, 1), from a xorshift generator per endpoint
+float64 loopback_chance(LoopbackTransport *t)
+{
+    t->random ^= t->random << 13;
+    t->random ^= t->random >> 7;
+    t->random ^= t->random << 17;
+    return (t->random >> 11) * (1.0 / (1ull << 53));
+}
+
+// The other end of a connection we can send over, NULL if there's none
+LoopbackConnection *loopback_destination(LoopbackTransport *t, NetHandle handle)
+{
+    LoopbackConnection *conn = loopback_connection(t, handle);
+    if (!conn || !conn->peer || conn->closed)
+        return NULL;
+    return loopback_connection(conn->peer, conn->peer_handle);
+}
+
+bool loopback_send_now(LoopbackTransport *t, NetHandle handle, void *buf, int len)
+{
+    LoopbackConnection *conn = loopback_connection(t, handle);
+    LoopbackConnection *dst = loopback_connection(conn->peer, conn->peer_handle);
+    MessageQueue *queue = dst->polled ? &conn->peer->poll_group : &dst->inbox;
+    return message_queue_push(queue, conn->peer_handle, dst->user_data, buf, len) != NULL;
+}
+
+bool loopback_send(Transport *base, NetHandle handle, void *buf, int len)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    LoopbackConnection *dst = loopback_destination(t, handle);
+    if (!dst) return false;
+    if (!loopback_link_simulated(t))
+        return loopback_send_now(t, handle, buf, len);
+
+    u64 arrival = loopback_time + t->link.latency;
+    while (loopback_chance(t) < t->link.loss)
+        arrival += t->link.resend_interval;
+    if (dst->reliable_in_flight.tail)
+        arrival = MAX(arrival, dst->reliable_in_flight.tail->arrival);
+
+    NetHandle peer_handle = loopback_connection(t, handle)->peer_handle;
+    TransportMessage *msg = message_queue_push(&dst->reliable_in_flight, peer_handle, 0, buf, len);
+    if (!msg) return false;
+    msg->arrival = arrival;
+    return true;
+}
+
+bool loopback_send_unreliable(Transport *base, NetHandle handle, void *buf, int len)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    LoopbackConnection *dst = loopback_destination(t, handle);
+    if (!dst || len > NET_MAX_UNRELIABLE_SIZE) return false;
+    if (!loopback_link_simulated(t))
+        return loopback_send_now(t, handle, buf, len);
+
+    if (loopback_chance(t) < t->link.loss)
+        return true; // Lost on the way
+
+    NetHandle peer_handle = loopback_connection(t, handle)->peer_handle;
+    TransportMessage *msg = message_queue_push(&dst->unreliable_in_flight, peer_handle, 0, buf, len);
+    if (!msg) return false;
+    msg->arrival = loopback_time + t->link.latency;
+    return true;
+}
+
+int loopback_receive(Transport *base, NetHandle handle, NetMessage *msgs, int max)
+{
+    LoopbackConnection *conn = loopback_connection((LoopbackTransport*) base, handle);
+    if (!conn) return -1;
+    return message_queue_receive(&conn->inbox, msgs, max);
+}
+
+bool loopback_join_poll_group(Transport *base, NetHandle handle, s64 user_data)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    LoopbackConnection *conn = loopback_connection(t, handle);
+    if (!conn || !conn->peer) return false;
+    message_queue_move(&t->poll_group, &conn->inbox);
+    message_queue_set_user_data(&t->poll_group, handle, user_data);
+    conn->polled = true;
+    conn->user_data = user_data;
+    return true;
+}
+
+int loopback_receive_on_poll_group(Transport *base, NetMessage *msgs, int max)
+{
+    return message_queue_receive(&((LoopbackTransport*) base)->poll_group, msgs, max);
+}
+
+void loopback_free(Transport *base)
+{
+    LoopbackTransport *t = (LoopbackTransport*) base;
+    loopback_reset(base);
+    for (NetHandle i = 0; i < LOOPBACK_MAX_CONNECTIONS; i++)
+        loopback_close(t, i);
+    message_queue_clear(&t->poll_group);
+
+    LoopbackTransport **prev = &loopback_endpoints;
+    while (*prev && *prev != t)
+        prev = &(*prev)->next;
+    if (*prev) *prev = t->next;
+}
+
+void loopback_transport_init(LoopbackTransport *t, u64 address)
+{
+    *t = (LoopbackTransport) {
+        .base = {
+            .name = "loopback",
+            .free = loopback_free,
+            .reset = loopback_reset,
+            .update = loopback_update,
+            .listen_start = loopback_listen_start,
+            .listen_stop = loopback_listen_stop,
+            .accept_connection = loopback_accept_connection,
+            .close_accepted_connection = loopback_close_accepted_connection,
+            .get_disconnect_message = loopback_get_disconnect_message,
+            .connect_start = loopback_connect_start,
+            .connect_stop = loopback_connect_stop,
+            .connect_status = loopback_connect_status,
+            .send = loopback_send,
+            .send_unreliable = loopback_send_unreliable,
+            .receive = loopback_receive,
+            .release = transport_release_messages,
+            .join_poll_group = loopback_join_poll_group,
+            .receive_on_poll_group = loopback_receive_on_poll_group,
+            .get_location = transport_no_location,
+            .estimate_ping_us = transport_no_ping_estimate,
+        },
+        .address = address,
+        .connect_status = CONNECT_FAILED,
+        .random = address * 0x9E3779B97F4A7C15ull | 1,
+    };
+    t->next = loopback_endpoints;
+    loopback_endpoints = t;
+}
+
+/*
+ * UDP transport. Every peer has one socket, a server tells its clients
+ * apart by their address. Messages are split into datagrams of at most
+ * UDP_MAX_PAYLOAD bytes, numbered per connection. The receiver only
+ * takes the one it expects next and acknowledges the ones it has with
+ * a cumulative ack, the sender resends everything unacknowledged when
+ * no ack came for UDP_RESEND_INTERVAL. That is go-back-N, which is
+ * plenty for a LAN where datagrams are rarely lost.
+ *
+ * Datagrams start with their type. Data ones follow it with their
+ * number and a byte that is 1 on the last datagram of a message, acks
+ * with the number of the next datagram expected. Unreliable ones with
+ * the whole message, they aren't numbered and are never resent.
+ */
+
+#define UDP_MAX_CONNECTIONS MAX_SNAKES
+#define UDP_MAX_PAYLOAD 1200
+#define UDP_HEADER_SIZE (1 + sizeof(u32) + 1)
+_Static_assert(1 + NET_MAX_UNRELIABLE_SIZE <= UDP_HEADER_SIZE + UDP_MAX_PAYLOAD, "Unreliable messages don't fit a datagram");
+#define UDP_CONNECT_INTERVAL 0.25  // Seconds between connection requests
+#define UDP_RESEND_INTERVAL 0.05
+#define UDP_KEEPALIVE_INTERVAL 1.0
+#define UDP_TIMEOUT 5.0            // Seconds without hearing from a peer before it's gone
+
+#ifdef _WIN32
+typedef SOCKET UdpSocket;
+typedef int socklen_t;
+#define UDP_INVALID_SOCKET INVALID_SOCKET
+#define udp_close_socket closesocket
+#else
+typedef int UdpSocket;
+#define UDP_INVALID_SOCKET (-1)
+#define udp_close_socket close
+#endif
+
+enum {
+    UDP_CONNECT,
+    UDP_ACCEPT,
+    UDP_DATA,
+    UDP_ACK,
+    UDP_CLOSE,
+    UDP_UNRELIABLE,
+};
+
+typedef struct {
+    bool used;
+    bool accepted;
+    bool closed;          // By the peer or because it went quiet
+    struct sockaddr_in addr;
+    u32 send_seq;         // Number of the next data datagram sent
+    u32 recv_seq;         // Number of the next data datagram expected
+    bool ack_due;
+    float64 last_send_time;
+    float64 last_recv_time;
+    float64 resend_time;  // When unacked was last sent or acknowledged
+    ByteQueue unacked;    // Data datagrams not acknowledged yet, each after its u16 size
+    ByteQueue partial;    // Start of the message being received, when it takes more than a datagram
+    bool polled;          // Its messages go to the poll group instead of the inbox
+    s64 user_data;
+    MessageQueue inbox;
+} UdpConnection;
+
+typedef struct {
+    Transport base;
+    UdpSocket socket;
+    bool listening;
+    int connect_status;
+    UdpConnection server; // NET_HANDLE_SERVER
+    UdpConnection clients[UDP_MAX_CONNECTIONS];
+    NetHandle disconnected[UDP_MAX_CONNECTIONS];
+    int num_disconnected;
+    MessageQueue poll_group;
+} UdpTransport;
+
+// Peer IDs of the UDP transport are an IPv4 address and port
+u64 udp_peer_id(u32 ipv4, u16 port)
+{
+    return (u64) ipv4 << 16 | port;
+}
+
+UdpConnection *udp_connection(UdpTransport *t, NetHandle handle)
+{
+    if (handle == NET_HANDLE_SERVER)
+        return &t->server;
+    if (handle < UDP_MAX_CONNECTIONS)
+        return &t->clients[handle];
+    return NULL;
+}
+
+void udp_send_datagram(UdpTransport *t, UdpConnection *conn, void *data, int len)
+{
+    sendto(t->socket, data, len, 0, (struct sockaddr*) &conn->addr, sizeof(conn->addr));
+    conn->last_send_time = os_get_current_time_in_seconds();
+}
+
+void udp_send_control(UdpTransport *t, UdpConnection *conn, u8 type)
+{
+    udp_send_datagram(t, conn, &type, sizeof(type));
+}
+
+void udp_send_ack(UdpTransport *t, UdpConnection *conn)
+{
+    u8 datagram[1 + sizeof(u32)];
+    u32 seq = htonl(conn->recv_seq);
+    datagram[0] = UDP_ACK;
+    memcpy(datagram + 1, &seq, sizeof(seq));
+    udp_send_datagram(t, conn, datagram, sizeof(datagram));
+    conn->ack_due = false;
+}
+
+void udp_free_connection(UdpTransport *t, UdpConnection *conn, NetHandle handle)
+{
+    if (conn->polled)
+        message_queue_remove(&t->poll_group, handle);
+    byte_queue_free(&conn->unacked);
+    byte_queue_free(&conn->partial);
+    message_queue_clear(&conn->inbox);
+    *conn = (UdpConnection) {0};
+}
+
+// The peer closed the connection or stopped answering
+void udp_lost_connection(UdpTransport *t, UdpConnection *conn, NetHandle handle)
+{
+    if (conn->closed) return;
+    conn->closed = true;
+
+    if (handle == NET_HANDLE_SERVER)
+        t->connect_status = CONNECT_FAILED;
+    else if (!conn->accepted)
+        udp_free_connection(t, conn, handle);
+    else if (t->num_disconnected < UDP_MAX_CONNECTIONS)
+        t->disconnected[t->num_disconnected++] = handle;
+}
+
+void udp_close(UdpTransport *t, NetHandle handle)
+{
+    UdpConnection *conn = udp_connection(t, handle);
+    if (!conn || !conn->used) return;
+    if (!conn->closed)
+        udp_send_control(t, conn, UDP_CLOSE);
+    udp_free_connection(t, conn, handle);
+}
+
+void udp_listen_stop(Transport *base)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    for (NetHandle i = 0; i < UDP_MAX_CONNECTIONS; i++)
+        if (t->clients[i].used && !t->clients[i].accepted)
+            udp_close(t, i);
+    t->listening = false;
+}
+
+bool udp_listen_start(Transport *base)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    if (t->listening || t->server.used)
+        return false;
+    t->listening = true;
+    return true;
+}
+
+NetHandle udp_accept_connection(Transport *base)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    for (NetHandle i = 0; i < UDP_MAX_CONNECTIONS; i++) {
+        UdpConnection *conn = &t->clients[i];
+        if (conn->used && !conn->accepted && !conn->closed) {
+            conn->accepted = true;
+            return i;
+        }
+    }
+    return NET_HANDLE_INVALID;
+}
+
+void udp_close_accepted_connection(Transport *base, NetHandle handle)
+{
+    udp_close((UdpTransport*) base, handle);
+}
+
+NetHandle udp_get_disconnect_message(Transport *base)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    if (t->num_disconnected == 0)
+        return NET_HANDLE_INVALID;
+    return t->disconnected[--t->num_disconnected];
+}
+
+bool udp_connect_start(Transport *base, u64 peer_id)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    if (t->listening || t->server.used)
+        return false;
+
+    UdpConnection *conn = &t->server;
+    *conn = (UdpConnection) {0};
+    conn->used = true;
+    conn->addr.sin_family = AF_INET;
+    conn->addr.sin_addr.s_addr = htonl((u32) (peer_id >> 16));
+    conn->addr.sin_port = htons((u16) peer_id);
+    conn->last_recv_time = os_get_current_time_in_seconds();
+    t->connect_status = CONNECT_PENDING;
+    udp_send_control(t, conn, UDP_CONNECT);
+    return true;
+}
+
+void udp_connect_stop(Transport *base)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    udp_close(t, NET_HANDLE_SERVER);
+    t->connect_status = CONNECT_FAILED;
+}
+
+int udp_connect_status(Transport *base)
+{
+    return ((UdpTransport*) base)->connect_status;
+}
+
+void udp_reset(Transport *base)
+{
+    udp_listen_stop(base);
+    udp_connect_stop(base);
+}
+
+bool udp_send(Transport *base, NetHandle handle, void *buf, int len)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    UdpConnection *conn = udp_connection(t, handle);
+    if (!conn || !conn->used || conn->closed)
+        return false;
+
+    if (byte_queue_used_space(&conn->unacked) == 0)
+        conn->resend_time = os_get_current_time_in_seconds();
+
+    int sent = 0;
+    do {
+        int payload = MIN(len - sent, UDP_MAX_PAYLOAD);
+        u16 size = UDP_HEADER_SIZE + payload;
+        if (!byte_queue_ensure_min_free_space(&conn->unacked, sizeof(size) + size))
+            return false;
+
+        u8 *dst = (u8*) byte_queue_start_write(&conn->unacked);
+        u32 seq = htonl(conn->send_seq++);
+        memcpy(dst, &size, sizeof(size));
+        dst += sizeof(size);
+        dst[0] = UDP_DATA;
+        memcpy(dst + 1, &seq, sizeof(seq));
+        dst[1 + sizeof(seq)] = sent + payload == len;
+        memcpy(dst + UDP_HEADER_SIZE, (u8*) buf + sent, payload);
+        byte_queue_end_write(&conn->unacked, sizeof(size) + size);
+
+        udp_send_datagram(t, conn, dst, size);
+        sent += payload;
+    } while (sent < len);
+
+    return true;
+}
+
+bool udp_send_unreliable(Transport *base, NetHandle handle, void *buf, int len)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    UdpConnection *conn = udp_connection(t, handle);
+    if (!conn || !conn->used || conn->closed || len > NET_MAX_UNRELIABLE_SIZE)
+        return false;
+
+    u8 datagram[1 + NET_MAX_UNRELIABLE_SIZE];
+    datagram[0] = UDP_UNRELIABLE;
+    memcpy(datagram + 1, buf, len);
+    udp_send_datagram(t, conn, datagram, 1 + len);
+    return true;
+}
+
+int udp_receive(Transport *base, NetHandle handle, NetMessage *msgs, int max)
+{
+    UdpConnection *conn = udp_connection((UdpTransport*) base, handle);
+    if (!conn) return -1;
+    return message_queue_receive(&conn->inbox, msgs, max);
+}
+
+bool udp_join_poll_group(Transport *base, NetHandle handle, s64 user_data)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    UdpConnection *conn = udp_connection(t, handle);
+    if (!conn || !conn->used) return false;
+    message_queue_move(&t->poll_group, &conn->inbox);
+    message_queue_set_user_data(&t->poll_group, handle, user_data);
+    conn->polled = true;
+    conn->user_data = user_data;
+    return true;
+}
+
+int udp_receive_on_poll_group(Transport *base, NetMessage *msgs, int max)
+{
+    return message_queue_receive(&((UdpTransport*) base)->poll_group, msgs, max);
+}
+
+// Drops the datagrams the peer acknowledged
+void udp_receive_ack(UdpConnection *conn, u32 ack)
+{
+    bool progress = false;
+    for (;;) {
+        u16 size;
+        u32 seq;
+        if (byte_queue_used_space(&conn->unacked) < sizeof(size)) break;
+        char *src = byte_queue_start_read(&conn->unacked);
+        memcpy(&size, src, sizeof(size));
+        memcpy(&seq, src + sizeof(size) + 1, sizeof(seq));
+        if ((s32) (ack - ntohl(seq)) <= 0) break;
+        byte_queue_end_read(&conn->unacked, sizeof(size) + size);
+        progress = true;
+    }
+    if (progress)
+        conn->resend_time = os_get_current_time_in_seconds();
+}
+
+void udp_receive_data(UdpTransport *t, UdpConnection *conn, NetHandle handle, u8 *datagram, int len)
+{
+    if (len < UDP_HEADER_SIZE) return;
+
+    MessageQueue *queue = conn->polled ? &t->poll_group : &conn->inbox;
+
+    u32 seq;
+    memcpy(&seq, datagram + 1, sizeof(seq));
+    conn->ack_due = true;
+    if (ntohl(seq) != conn->recv_seq)
+        return; // Already had it, or one before it was lost
+
+    int payload = len - UDP_HEADER_SIZE;
+    bool last = datagram[1 + sizeof(seq)];
+
+    // Messages that fit a datagram go straight to the inbox
+    if (last && byte_queue_used_space(&conn->partial) == 0) {
+        if (message_queue_push(queue, handle, conn->user_data, datagram + UDP_HEADER_SIZE, payload))
+            conn->recv_seq++;
+        return;
+    }
+
+    if (!byte_queue_ensure_min_free_space(&conn->partial, payload))
+        return;
+    memcpy(byte_queue_start_write(&conn->partial), datagram + UDP_HEADER_SIZE, payload);
+    byte_queue_end_write(&conn->partial, payload);
+    conn->recv_seq++;
+
+    if (last) {
+        int size = byte_queue_used_space(&conn->partial);
+        message_queue_push(queue, handle, conn->user_data, byte_queue_start_read(&conn->partial), size);
+        byte_queue_end_read(&conn->partial, size);
+    }
+}
+
+void udp_receive_datagram(UdpTransport *t, struct sockaddr_in *from, u8 *datagram, int len)
+{
+    if (len < 1) return;
+
+    NetHandle handle = NET_HANDLE_INVALID;
+    UdpConnection *conn = NULL;
+    if (t->server.used && t->server.addr.sin_addr.s_addr == from->sin_addr.s_addr && t->server.addr.sin_port == from->sin_port) {
+        handle = NET_HANDLE_SERVER;
+        conn = &t->server;
+    } else {
+        for (NetHandle i = 0; i < UDP_MAX_CONNECTIONS; i++) {
+            UdpConnection *client = &t->clients[i];
+            if (client->used && client->addr.sin_addr.s_addr == from->sin_addr.s_addr && client->addr.sin_port == from->sin_port) {
+                handle = i;
+                conn = client;
+                break;
+            }
+        }
+    }
+
+    if (!conn) {
+        if (datagram[0] != UDP_CONNECT || !t->listening)
+            return;
+        for (NetHandle i = 0; i < UDP_MAX_CONNECTIONS; i++) {
+            if (t->clients[i].used) continue;
+            conn = &t->clients[i];
+            handle = i;
+            *conn = (UdpConnection) {0};
+            conn->used = true;
+            conn->addr = *from;
+            break;
+        }
+        if (!conn) return; // Server full, the client will time out
+    }
+
+    if (conn->closed) return;
+    conn->last_recv_time = os_get_current_time_in_seconds();
+
+    // Anything from the server means it took us, even if its accept was lost
+    if (handle == NET_HANDLE_SERVER && t->connect_status == CONNECT_PENDING && datagram[0] != UDP_CLOSE)
+        t->connect_status = CONNECT_OK;
+
+    switch (datagram[0]) {
+
+        case UDP_CONNECT:
+        // Also answers requests whose answer was lost
+        if (handle != NET_HANDLE_SERVER)
+            udp_send_control(t, conn, UDP_ACCEPT);
+        break;
+
+        case UDP_DATA:
+        udp_receive_data(t, conn, handle, datagram, len);
+        break;
+
+        case UDP_ACK:
+        if (len >= 1 + sizeof(u32)) {
+            u32 ack;
+            memcpy(&ack, datagram + 1, sizeof(ack));
+            udp_receive_ack(conn, ntohl(ack));
+        }
+        break;
+
+        case UDP_CLOSE:
+        udp_lost_connection(t, conn, handle);
+        break;
+
+        case UDP_UNRELIABLE:
+        message_queue_push(conn->polled ? &t->poll_group : &conn->inbox, handle, conn->user_data, datagram + 1, len - 1);
+        break;
+    }
+}
+
+// Resends what wasn't acknowledged, acknowledges what was received and
+// keeps quiet connections alive
+void udp_update_connection(UdpTransport *t, UdpConnection *conn, NetHandle handle, float64 now)
+{
+    if (!conn->used || conn->closed) return;
+
+    if (now - conn->last_recv_time > UDP_TIMEOUT) {
+        udp_lost_connection(t, conn, handle);
+        return;
+    }
+
+    if (handle == NET_HANDLE_SERVER && t->connect_status == CONNECT_PENDING) {
+        if (now - conn->last_send_time > UDP_CONNECT_INTERVAL)
+            udp_send_control(t, conn, UDP_CONNECT);
+        return;
+    }
+
+    if (byte_queue_used_space(&conn->unacked) > 0 && now - conn->resend_time > UDP_RESEND_INTERVAL) {
+        char *src = byte_queue_start_read(&conn->unacked);
+        char *end = src + byte_queue_used_space(&conn->unacked);
+        while (src < end) {
+            u16 size;
+            memcpy(&size, src, sizeof(size));
+            udp_send_datagram(t, conn, src + sizeof(size), size);
+            src += sizeof(size) + size;
+        }
+        conn->resend_time = now;
+    }
+
+    if (conn->ack_due || now - conn->last_send_time > UDP_KEEPALIVE_INTERVAL)
+        udp_send_ack(t, conn);
+}
+
+void udp_update(Transport *base)
+{
+    UdpTransport *t = (UdpTransport*) base;
+
+    for (;;) {
+        u8 datagram[UDP_HEADER_SIZE + UDP_MAX_PAYLOAD];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(t->socket, (char*) datagram, sizeof(datagram), 0, (struct sockaddr*) &from, &from_len);
+        if (len < 0) break; // Nothing left, or an error that the timeouts will deal with
+        udp_receive_datagram(t, &from, datagram, len);
+    }
+
+    float64 now = os_get_current_time_in_seconds();
+    udp_update_connection(t, &t->server, NET_HANDLE_SERVER, now);
+    for (NetHandle i = 0; i < UDP_MAX_CONNECTIONS; i++)
+        udp_update_connection(t, &t->clients[i], i, now);
+}
+
+void udp_free(Transport *base)
+{
+    UdpTransport *t = (UdpTransport*) base;
+    udp_reset(base);
+    for (NetHandle i = 0; i < UDP_MAX_CONNECTIONS; i++)
+        udp_close(t, i);
+    message_queue_clear(&t->poll_group);
+    if (t->socket != UDP_INVALID_SOCKET)
+        udp_close_socket(t->socket);
+    t->socket = UDP_INVALID_SOCKET;
+}
+
+// Port the socket is bound to, which the system picks when
+// udp_transport_init is given port 0
+u16 udp_transport_port(UdpTransport *t)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(t->socket, (struct sockaddr*) &addr, &len))
+        return 0;
+    return ntohs(addr.sin_port);
+}
+
+bool udp_transport_init(UdpTransport *t, u16 port)
+{
+    *t = (UdpTransport) {
+        .base = {
+            .name = "udp",
+            .free = udp_free,
+            .reset = udp_reset,
+            .update = udp_update,
+            .listen_start = udp_listen_start,
+            .listen_stop = udp_listen_stop,
+            .accept_connection = udp_accept_connection,
+            .close_accepted_connection = udp_close_accepted_connection,
+            .get_disconnect_message = udp_get_disconnect_message,
+            .connect_start = udp_connect_start,
+            .connect_stop = udp_connect_stop,
+            .connect_status = udp_connect_status,
+            .send = udp_send,
+            .send_unreliable = udp_send_unreliable,
+            .receive = udp_receive,
+            .release = transport_release_messages,
+            .join_poll_group = udp_join_poll_group,
+            .receive_on_poll_group = udp_receive_on_poll_group,
+            .get_location = transport_no_location,
+            .estimate_ping_us = transport_no_ping_estimate,
+        },
+        .socket = UDP_INVALID_SOCKET,
+        .connect_status = CONNECT_FAILED,
+    };
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+        printf("Couldn't initialize Winsock\n");
+        return false;
+    }
+#endif
+
+    t->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (t->socket == UDP_INVALID_SOCKET) {
+        printf("Couldn't create the UDP socket\n");
+        return false;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(t->socket, (struct sockaddr*) &addr, sizeof(addr))) {
+        printf("Couldn't bind the UDP socket to port %d\n", port);
+        udp_free(&t->base);
+        return false;
+    }
+
+#ifdef _WIN32
+    u_long nonblocking = 1;
+    bool ok = ioctlsocket(t->socket, FIONBIO, &nonblocking) == 0;
+#else
+    bool ok = fcntl(t->socket, F_SETFL, O_NONBLOCK) == 0;
+#endif
+    if (!ok) {
+        printf("Couldn't make the UDP socket non-blocking\n");
+        udp_free(&t->base);
+        return false;
+    }
+    return true;
+}
+
+#endif /* HAVE_MULTIPLAYER */
@@ -0,0 +1,158 @@
+/*
+ * Undo log for the rollback history, used instead of a full copy of
+ * the GameState per frame when ROLLBACK_UNDO_LOG is set.
+ *
+ * Before game.c writes a field of the state being logged it calls
+ * UNDO(field), which appends the old bytes of the field and where they
+ * go to a ring buffer. Rolling back to an earlier position of the log
+ * writes them back newest first. So the cost of a frame is
+ * proportional to what changed during it instead of to the size of
+ * the state.
+ *
+ * The log is only rewound to the start of a frame, so a field needs
+ * one record per frame at most. The scalar fields of GameState (frame
+ * index, seed, hash, free cell count, ...) change many times a frame
+ * and are logged once by save_snapshot instead of at every write, and
+ * a moving snake logs all of its own fields at once.
+ *
+ * Writes to any other state (snapshots, batch instances, ...) fall
+ * outside the logged range and aren't recorded.
+ *
+ * Copying snapshots is cheaper while the state is small or most of it
+ * changes every frame, so the log only wins on large worlds with few
+ * snakes (bench_world_sizes.sh runs both).
+ */
+
+#if ROLLBACK_UNDO_LOG
+
+// A cell that changes logs itself, its word of free cells and the
+// Fenwick nodes above that word, at most one per bit of the number of
+// words
+#define UNDO_FREE_CELL_WORDS ((MAX_WORLD_W * MAX_WORLD_H + 63) / 64)
+#if UNDO_FREE_CELL_WORDS < (1 << 4)
+#define UNDO_FENWICK_DEPTH 4
+#elif UNDO_FREE_CELL_WORDS < (1 << 8)
+#define UNDO_FENWICK_DEPTH 8
+#elif UNDO_FREE_CELL_WORDS < (1 << 12)
+#define UNDO_FENWICK_DEPTH 12
+#elif UNDO_FREE_CELL_WORDS < (1 << 16)
+#define UNDO_FENWICK_DEPTH 16
+#else
+#define UNDO_FENWICK_DEPTH 24
+#endif
+#define UNDO_BYTES_PER_CELL (32 + 12 * UNDO_FENWICK_DEPTH)
+
+// Every move writes a handful of fields per snake, and kills vacate
+// at most every cell of the world once per rollback window.
+#define UNDO_LOG_MIN_SIZE ((MAX_ROLLBACK_FRAMES + 1) * MAX_SNAKES * 512 + MAX_WORLD_W * MAX_WORLD_H * UNDO_BYTES_PER_CELL)
+
+// Unless it's set, the log is the smallest power of two that holds that
+#ifndef UNDO_LOG_SIZE_LOG2
+#if UNDO_LOG_MIN_SIZE <= (1 << 20)
+#define UNDO_LOG_SIZE_LOG2 20
+#elif UNDO_LOG_MIN_SIZE <= (1 << 21)
+#define UNDO_LOG_SIZE_LOG2 21
+#elif UNDO_LOG_MIN_SIZE <= (1 << 22)
+#define UNDO_LOG_SIZE_LOG2 22
+#elif UNDO_LOG_MIN_SIZE <= (1 << 23)
+#define UNDO_LOG_SIZE_LOG2 23
+#elif UNDO_LOG_MIN_SIZE <= (1 << 24)
+#define UNDO_LOG_SIZE_LOG2 24
+#elif UNDO_LOG_MIN_SIZE <= (1 << 25)
+#define UNDO_LOG_SIZE_LOG2 25
+#elif UNDO_LOG_MIN_SIZE <= (1 << 26)
+#define UNDO_LOG_SIZE_LOG2 26
+#elif UNDO_LOG_MIN_SIZE <= (1 << 27)
+#define UNDO_LOG_SIZE_LOG2 27
+#elif UNDO_LOG_MIN_SIZE <= (1 << 28)
+#define UNDO_LOG_SIZE_LOG2 28
+#elif UNDO_LOG_MIN_SIZE <= (1 << 29)
+#define UNDO_LOG_SIZE_LOG2 29
+#else
+#define UNDO_LOG_SIZE_LOG2 30
+#endif
+#endif
+
+#define UNDO_LOG_SIZE (1 << UNDO_LOG_SIZE_LOG2)
+#define UNDO_LOG_MASK (UNDO_LOG_SIZE - 1)
+
+_Static_assert(UNDO_LOG_SIZE >= UNDO_LOG_MIN_SIZE, "The undo log can't hold a rollback window, raise UNDO_LOG_SIZE_LOG2");
+
+typedef struct {
+    u32 offset; // From the start of the logged state
+    u32 size;
+} UndoRecord; // Stored after the bytes it describes
+
+u8  undo_log[UNDO_LOG_SIZE];
+u64 undo_log_end; // Bytes written so far, the log keeps the last UNDO_LOG_SIZE
+
+uintptr_t undo_base;
+u32 undo_base_size;
+
+#define UNDO(field) undo_save(&(field), sizeof(field))
+#define UNDO_BYTES(data, size) undo_save(data, size)
+
+// Starts logging the writes to the given state
+void undo_attach(void *base, u32 size)
+{
+    undo_base = (uintptr_t) base;
+    undo_base_size = size;
+}
+
+void undo_log_write(void *data, u32 size)
+{
+    u32 start = undo_log_end & UNDO_LOG_MASK;
+    u32 first = MIN(size, UNDO_LOG_SIZE - start);
+    memcpy(undo_log + start, data, first);
+    memcpy(undo_log, (u8*) data + first, size - first);
+    undo_log_end += size;
+}
+
+void undo_log_read(u64 position, void *data, u32 size)
+{
+    u32 start = position & UNDO_LOG_MASK;
+    u32 first = MIN(size, UNDO_LOG_SIZE - start);
+    memcpy(data, undo_log + start, first);
+    memcpy((u8*) data + first, undo_log, size - first);
+}
+
+static inline void undo_save(void *field, u32 size)
+{
+    uintptr_t offset = (uintptr_t) field - undo_base;
+    if (offset >= undo_base_size)
+        return;
+
+    UndoRecord record = {.offset=offset, .size=size};
+
+    // Records rarely wrap around the end of the buffer
+    u32 start = undo_log_end & UNDO_LOG_MASK;
+    if (start + size + sizeof(record) <= UNDO_LOG_SIZE) {
+        memcpy(undo_log + start, field, size);
+        memcpy(undo_log + start + size, &record, sizeof(record));
+        undo_log_end += size + sizeof(record);
+    } else {
+        undo_log_write(field, size);
+        undo_log_write(&record, sizeof(record));
+    }
+}
+
+// Restores the logged state as it was when the log ended at position
+void undo_rewind(u64 position)
+{
+    assert(undo_log_end - position <= UNDO_LOG_SIZE, "The undo log doesn't reach back that far");
+
+    while (undo_log_end > position) {
+        UndoRecord record;
+        undo_log_read(undo_log_end - sizeof(record), &record, sizeof(record));
+        undo_log_end -= sizeof(record) + record.size;
+        undo_log_read(undo_log_end, (u8*) undo_base + record.offset, record.size);
+    }
+    assert(undo_log_end == position);
+}
+
+#else
+
+#define UNDO(field)
+#define UNDO_BYTES(data, size)
+
+#endif
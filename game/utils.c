@@ -1,6 +1,11 @@
 #define COUNTOF(X) (sizeof(X)/sizeof((X)[0]))
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
+#define IS_POW2(X) ((X) > 0 && ((X) & ((X) - 1)) == 0)
+
+// Smallest power of two not less than X, as a constant expression
+#define SMEAR_BITS_(X, S) ((X) | (X) >> (S))
+#define ROUND_UP_POW2(X) (SMEAR_BITS_(SMEAR_BITS_(SMEAR_BITS_(SMEAR_BITS_(SMEAR_BITS_((u32) (X) - 1, 1), 2), 4), 8), 16) + 1)
 #define LIT(s) (string) {.count=sizeof(s)-1, .data=(u8*)(s)}
 
 typedef enum {
@@ -11,10 +16,102 @@ typedef enum {
     DIR_RIGHT = -2,
 } Direction;
 
+// Directions as 2 bits, for the replays and the wire protocol
+u8 direction_to_bits(Direction dir)
+{
+    switch (dir) {
+        case DIR_UP   : return 0;
+        case DIR_DOWN : return 1;
+        case DIR_LEFT : return 2;
+        case DIR_RIGHT: return 3;
+    }
+    return 0;
+}
+
+Direction bits_to_direction(u8 bits)
+{
+    static const Direction dirs[] = {DIR_UP, DIR_DOWN, DIR_LEFT, DIR_RIGHT};
+    return dirs[bits & 3];
+}
+
 typedef struct {
     float x, y, w, h;
 } Rect;
 
+int count_set_bits(u64 word)
+{
+    return __builtin_popcountll(word);
+}
+
+// Position of the n-th (starting from 0) set bit of the word
+int index_of_nth_set_bit(u64 word, int n)
+{
+    assert(n < count_set_bits(word));
+    while (n-- > 0)
+        word &= word - 1; // Clear the lowest set bit
+    return __builtin_ctzll(word);
+}
+
+// LEB128: 7 bits per byte, low bits first, with the top bit set on
+// every byte but the last. Returns the number of bytes written, at
+// most 10.
+int write_varint(u8 *dst, u64 value)
+{
+    int n = 0;
+    while (value >= 0x80) {
+        dst[n++] = (u8) value | 0x80;
+        value >>= 7;
+    }
+    dst[n++] = (u8) value;
+    return n;
+}
+
+// Reads a varint and moves *src past it
+u64 read_varint(u8 **src)
+{
+    u64 value = 0;
+    u8 *p = *src;
+    for (int shift = 0; shift < 64; shift += 7) {
+        u8 byte = *p++;
+        value |= (u64) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    *src = p;
+    return value;
+}
+
+// Like read_varint, for data that may be cut short or malformed.
+// Returns false instead of reading past end.
+bool read_varint_checked(u8 **src, u8 *end, u64 *value)
+{
+    u64 result = 0;
+    u8 *p = *src;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p == end)
+            return false;
+        u8 byte = *p++;
+        result |= (u64) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *src = p;
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Maps signed values to varint friendly ones: 0, -1, 1, -2, 2...
+// become 0, 1, 2, 3, 4...
+u64 zigzag_encode(s64 value)
+{
+    return (u64) value << 1 ^ (u64) (value >> 63);
+}
+
+s64 zigzag_decode(u64 value)
+{
+    return (s64) (value >> 1) ^ -(s64) (value & 1);
+}
+
 bool almost_equals(float a, float b, float epsilon)
 {
     return fabs(a - b) <= epsilon;
@@ -38,6 +135,7 @@ void animate_rect_to_target(Rect *value, Rect target, float delta_t, float rate)
     animate_f32_to_target(&value->h, target.h, delta_t, rate);
 }
 
+#ifndef OOGABOOGA_HEADLESS
 #define m4_identity m4_make_scale(v3(1, 1, 1))
 
 void draw_subimage(Gfx_Image *image, float rotate,
@@ -70,6 +168,8 @@ void draw_rect_border(Rect rect, float line_w, Vector4 color)
     draw_line(v2(rect.x,          rect.y + rect.h), v2(rect.x,          rect.y         ), line_w, color);
 }
 
+#endif /* OOGABOOGA_HEADLESS */
+
 Rect padded_rect(Rect r, float pad)
 {
     r.x -= pad;
@@ -79,11 +179,13 @@ Rect padded_rect(Rect r, float pad)
     return r;
 }
 
+#ifndef OOGABOOGA_HEADLESS
 bool mouse_in_rect(Rect rect)
 {
     return input_frame.mouse_x >= rect.x && input_frame.mouse_x < rect.x + rect.w &&
            input_frame.mouse_y >= rect.y && input_frame.mouse_y < rect.y + rect.h;
 }
+#endif /* OOGABOOGA_HEADLESS */
 
 #ifdef _WIN32
 #define WIN32_MEAN_AND_LEAN